@@ -0,0 +1,168 @@
+#include "cell_map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int _cell_map_hash(CellMap *map, int cell);
+static int _cell_map_find(CellMap *map, int cell);
+static void _cell_map_grow(CellMap *map);
+
+static unsigned int
+_cell_map_hash(CellMap *map, int cell)
+{
+	/* Fibonacci hashing, the high bits spread neighbour cells over the table */
+	return ((unsigned int)cell * 2654435769u) >> map->shift;
+}
+
+static int
+_cell_map_find(CellMap *map, int cell)
+{
+	unsigned int i;
+
+	/* The slot of the cell, or the empty slot where it would go */
+	i = _cell_map_hash(map, cell);
+	while (map->key[i] != -1 && map->key[i] != cell)
+		i = (i + 1) & (map->cap - 1);
+
+	return i;
+}
+
+static void
+_cell_map_grow(CellMap *map)
+{
+	int *old_key;
+	int *old_count;
+	int old_cap;
+	int i;
+	int j;
+
+	old_key = map->key;
+	old_count = map->count;
+	old_cap = map->cap;
+
+	cell_map_init(map, old_cap * 2);
+	for (i = 0; i < old_cap; i++)
+	{
+		if (old_key[i] == -1)
+			continue;
+		j = _cell_map_find(map, old_key[i]);
+		map->key[j] = old_key[i];
+		map->count[j] = old_count[i];
+		map->n++;
+	}
+
+	free(old_key);
+	free(old_count);
+}
+
+void
+cell_map_init(CellMap *map, int cap)
+{
+	int c;
+
+	c = 16;
+	map->shift = 28;
+	while (c < cap)
+	{
+		c *= 2;
+		map->shift--;
+	}
+
+	map->cap = c;
+	map->n = 0;
+	map->key = malloc(sizeof(int) * c);
+	map->count = malloc(sizeof(int) * c);
+	memset(map->key, 0xff, sizeof(int) * c);
+}
+
+void
+cell_map_release(CellMap *map)
+{
+	free(map->key);
+	free(map->count);
+	map->key = NULL;
+	map->count = NULL;
+	map->cap = 0;
+	map->n = 0;
+}
+
+void
+cell_map_clear(CellMap *map)
+{
+	memset(map->key, 0xff, sizeof(int) * map->cap);
+	map->n = 0;
+}
+
+int
+cell_map_get(CellMap *map, int cell)
+{
+	int i;
+
+	i = _cell_map_find(map, cell);
+	if (map->key[i] == -1)
+		return 0;
+
+	return map->count[i];
+}
+
+int
+cell_map_add(CellMap *map, int cell)
+{
+	int i;
+
+	/* Returns the new count */
+	i = _cell_map_find(map, cell);
+	if (map->key[i] != -1)
+		return ++map->count[i];
+
+	if ((map->n + 1) * 2 > map->cap)
+	{
+		_cell_map_grow(map);
+		i = _cell_map_find(map, cell);
+	}
+
+	map->key[i] = cell;
+	map->count[i] = 1;
+	map->n++;
+
+	return 1;
+}
+
+int
+cell_map_remove(CellMap *map, int cell)
+{
+	unsigned int i;
+	unsigned int j;
+	unsigned int home;
+
+	/* Returns the new count, -1 if the cell was not in it */
+	i = _cell_map_find(map, cell);
+	if (map->key[i] == -1)
+		return -1;
+
+	if (--map->count[i] > 0)
+		return map->count[i];
+
+	/* Shift the following entries back so no probe chain breaks */
+	map->n--;
+	j = i;
+	while (1)
+	{
+		j = (j + 1) & (map->cap - 1);
+		if (map->key[j] == -1)
+			break;
+
+		home = _cell_map_hash(map, map->key[j]);
+		/* Entry j may move to i only if i is on its probe path */
+		if (((j - home) & (map->cap - 1)) < ((j - i) & (map->cap - 1)))
+			continue;
+
+		map->key[i] = map->key[j];
+		map->count[i] = map->count[j];
+		i = j;
+	}
+	map->key[i] = -1;
+
+	return 0;
+}
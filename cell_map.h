@@ -0,0 +1,29 @@
+#ifndef __CELL_MAP_H
+#define __CELL_MAP_H
+
+/*
+ * A hash map from cell index to a count.
+ * Open addressing with linear probing, grows so it stays at most half full.
+ * Its size follows how many cells are in it, not the field.
+ */
+typedef struct {
+	int cap;	/* Number of slots, a power of 2 */
+	int shift;	/* 32 - log2(cap) */
+	int n;		/* Number of cells with a count */
+	int *key;	/* Cell index of the slot, -1 if empty */
+	int *count;
+} CellMap;
+
+void cell_map_init(CellMap *map, int cap);
+
+void cell_map_release(CellMap *map);
+
+void cell_map_clear(CellMap *map);
+
+int cell_map_get(CellMap *map, int cell);
+
+int cell_map_add(CellMap *map, int cell);
+
+int cell_map_remove(CellMap *map, int cell);
+
+#endif /* __CELL_MAP_H */
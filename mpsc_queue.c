@@ -0,0 +1,63 @@
+#include "mpsc_queue.h"
+
+#include <stddef.h>
+
+void
+mpsc_queue_init(MpscQueue *queue)
+{
+	atomic_init(&queue->stub.next, NULL);
+	atomic_init(&queue->head, &queue->stub);
+	queue->tail = &queue->stub;
+}
+
+void
+mpsc_queue_push(MpscQueue *queue, MpscNode *node)
+{
+	MpscNode *prev;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+	/* Until this store the node is pushed but not reachable, pop sees that as empty */
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+MpscNode *
+mpsc_queue_pop(MpscQueue *queue)
+{
+	MpscNode *tail;
+	MpscNode *next;
+
+	tail = queue->tail;
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	/* Step over the stub */
+	if (tail == &queue->stub)
+	{
+		if (next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+
+	if (next)
+	{
+		queue->tail = next;
+		return tail;
+	}
+
+	/* A producer is between its exchange and its link, try again later */
+	if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+		return NULL;
+
+	/* tail is the last node, put the stub behind it so it can be handed out */
+	mpsc_queue_push(queue, &queue->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next)
+	{
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef __MPSC_QUEUE_H
+#define __MPSC_QUEUE_H
+
+#include <stdatomic.h>
+
+/* Embedded in whatever goes through the queue */
+typedef struct MpscNode {
+	_Atomic(struct MpscNode *) next;
+} MpscNode;
+
+/*
+ * A queue any number of threads push to and one thread pops from (Vyukov's intrusive MPSC queue).
+ * Pushing is one atomic exchange and never waits, popping never takes a lock either.
+ * Nodes are owned by the caller, the queue only links them.
+ */
+typedef struct {
+	_Atomic(MpscNode *) head;	/* Last pushed, producers swap themselves in here */
+	MpscNode *tail;				/* Next to pop, only touched by the consumer */
+	MpscNode stub;				/* Keeps the queue non empty so head and tail never race on NULL */
+} MpscQueue;
+
+void mpsc_queue_init(MpscQueue *queue);
+
+void mpsc_queue_push(MpscQueue *queue, MpscNode *node);
+
+MpscNode *mpsc_queue_pop(MpscQueue *queue);
+
+#endif /* __MPSC_QUEUE_H */
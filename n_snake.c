@@ -7,13 +7,29 @@
 #include <time.h>
 #include <pthread.h>
 #include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 #include "snake_game.h"
 #include "neural_network.h"
 #include "neural_network_elite.h"
+#include "snake_eval.h"
+#include "snake_lookahead.h"
+#include "snake_replay.h"
+#include "snake_island.h"
+#include "mpsc_queue.h"
+#include "snake_surrogate.h"
 
 #define AI_STATUS_FILE	"snake.status"
+#define AI_REPLAY_FILE	"snake.replay"
+/* Marks the game rules appended after the elites, files without it are from legacy runs */
+#define AI_STATUS_CONFIG_MAGIC		0x43534e53
+#define AI_STATUS_CONFIG_VERSION	4
 #define MUTATION_RATE	0.1f
+/* Every child of a generation is mutated, so the generational mode mutates less */
+#define POPULATION_MUTATION_RATE	0.02f
 #define ELITE_THRESHOLD	0.8
 
 #define GAME_X			32
@@ -22,12 +38,79 @@
 
 #define GAME_RANDOM_MAP	0
 #define GAME_SEED		1128
+/* How many games a candidate plays with randomized map */
+#define GAME_RANDOM_MAP_N_GAME	10
+/* Games a racing candidate plays on top of those once its average reaches the elite threshold */
+#define GAME_RANDOM_MAP_N_EXTRA	10
+
+/* Contestants of a tournament selection */
+#define TOURNAMENT_SIZE	3
+/* 1 of this many children of a generation, plus 1, is carried over to the next one */
+#define POPULATION_ELITISM_RATIO	10
+
+/*
+ * Elites an island publishes per migration, and how many generations between migrations,
+ * the steady state loop counts this many children as a generation
+ */
+#define ISLAND_N_MIGRANT	3
+#define ISLAND_MIGRATE_GEN	10
+#define ISLAND_GEN_CHILD	100
+
+/* Max steps of a screening game, and every how many generations all children are also fully evaluated */
+#define SCREEN_MAX_STEP		100
+#define SCREEN_AUDIT_GEN	10
+
+/*
+ * The surrogate filters once it has learnt from this many children,
+ * it skips children it expects below this share of the elite threshold,
+ * but 1 of this many is evaluated anyway so it keeps learning from the whole range
+ */
+#define SURROGATE_WARMUP		500
+#define SURROGATE_SKIP_RATIO	0.5f
+#define SURROGATE_EXPLORE		10
+
+/* Decisions an evaluator remembers of the network it plays with --policy-cache */
+#define POLICY_CACHE_SLOT		4096
+
+/*
+ * Threads besides the workers which may read the published status without the lock,
+ * the display thread and the main thread, readers beyond these take status_lock instead
+ */
+#define AI_SNAPSHOT_MAX_READER	4
+
+/* Options without a short form */
+enum {
+	OPT_POPULATION = 256,
+	OPT_SELECTION,
+	OPT_ISLAND_DIR,
+	OPT_ISLAND_NAME,
+	OPT_MIGRATE,
+	OPT_NO_RACE,
+	OPT_SCREEN,
+	OPT_SCREEN_STEP,
+	OPT_SCREEN_SIZE,
+	OPT_SURROGATE,
+	OPT_POLICY_CACHE,
+};
+
+typedef enum {
+	SELECTION_TOURNAMENT,	/* The best of TOURNAMENT_SIZE random children */
+	SELECTION_RANK,			/* Chance falls linearly with the rank */
+} SELECTION;
 
 typedef struct AIStatus{
 	int gen;
 	float best_performance;
 	float best_score;
 	NNEliteList elite_list;
+
+	/* Game rules the elites were trained with */
+	FOOD_MODE food_mode;
+	OBS_ENCODER obs_encoder;
+	int obs_vision_size;
+	int size_x;
+	int size_y;
+	SNAKE_RNG rng;
 } AIStatus;
 
 typedef struct Param {
@@ -36,7 +119,27 @@ typedef struct Param {
 	float mutation_rate;
 	int progress;
 	int replay;
+	int lookahead;
+	int legacy_food;
+	const char *obs_encoder;	/* Encoder name of a new run */
+	int size_x;				/* Field of a new run */
+	int size_y;
+	int n_worker;			/* Threads producing and evaluating candidates */
+	int population;			/* Children per generation, 0 for the steady state loop */
+	SELECTION selection;	/* How the generational mode picks parents */
+	const char *island_dir;		/* Directory shared with other trainers, NULL to train alone */
+	const char *island_name;	/* Name of this trainer in island_dir */
+	int migrate_gen;			/* Generations between migrations */
+	int race;				/* Hopeless candidates of -r stop before all their games, promising ones play more */
+	float screen_fraction;	/* Children of a generation promoted past screening, 0 to evaluate all fully */
+	int screen_step;		/* Max steps of a screening game */
+	int screen_size_x;		/* Field of a screening game, 0 for half of the real one */
+	int screen_size_y;
+	int surrogate;			/* Children the surrogate expects to fail are not evaluated */
+	int policy_cache;		/* Evaluators remember the moves of the network they play */
 	const char *status_f;
+	const char *replay_f;	/* Every record game gets appended to it */
+	const char *play_f;		/* Replay file to play */
 } Param;
 
 static AIStatus status;
@@ -44,38 +147,209 @@ static Param param = {
 	/* Some default values */
 	.game_seed = GAME_SEED,
 	.game_rand_map = GAME_RANDOM_MAP,
-	.mutation_rate = MUTATION_RATE,
+	.mutation_rate = -1,	/* Depends on the mode unless set */
 	.progress = 0,
 	.replay = 0,
-	.status_f = AI_STATUS_FILE
+	.lookahead = 0,
+	.legacy_food = 0,
+	.obs_encoder = NULL,
+	.size_x = GAME_X,
+	.size_y = GAME_Y,
+	.n_worker = 1,
+	.population = 0,
+	.selection = SELECTION_TOURNAMENT,
+	.island_dir = NULL,
+	.island_name = NULL,
+	.migrate_gen = ISLAND_MIGRATE_GEN,
+	.race = 1,
+	.screen_fraction = 0,
+	.screen_step = SCREEN_MAX_STEP,
+	.screen_size_x = 0,
+	.screen_size_y = 0,
+	.surrogate = 0,
+	.policy_cache = 0,
+	.status_f = AI_STATUS_FILE,
+	.replay_f = AI_REPLAY_FILE,
+	.play_f = NULL
 };
 
 static int should_stop = 0;
 
+static SnakeGameConfig game_config = {
+	.size_x = GAME_X,
+	.size_y = GAME_Y,
+	.step_per_sec = 8,
+	.max_step = GAME_MAX_STEP,
+	.food_mode = FOOD_MODE_FREE_CELL,
+	.obs_encoder = OBS_ENCODER_BASIC,
+	.obs_vision_size = 0,
+	.rng = SNAKE_RNG_XOSHIRO,
+	.detect_loop = 0
+};
+
+/* Cheap proxy of game_config children are screened with */
+static SnakeGameConfig screen_config;
+
+/* A training thread, it owns its evaluators and the games in them */
+typedef struct {
+	pthread_t thread;
+	SnakeEval *evaluator;
+	SnakeEval *screener;	/* Plays screen_config, NULL without screening */
+	SnakeSurrogate *surrogate;	/* Learns from this worker's children, NULL without it */
+} AIWorker;
+
+/* An evaluated network on its way from a worker to the owner of the elites */
+typedef struct {
+	MpscNode node;			/* First, so a popped node is the result */
+	NeuralNetwork *nn;
+	float performance;
+	float score;
+	SnakeReplay *replay;	/* Best game, only kept if the network may set a record */
+} AIResult;
+
+/* A generation of the generational mode */
+typedef struct {
+	int n;
+	NeuralNetwork **nn;
+	float *performance;
+	int *rank;			/* Children from the best to the worst */
+
+	/* Children the running phase evaluates, and if it screens them instead of playing the full games */
+	int *eval;
+	int n_eval;
+	int screening;
+	float *screen;		/* Performance on the screening proxy */
+	int screen_seed;
+
+	/* Every child plays the same games so they are compared fairly */
+	int seeds[GAME_RANDOM_MAP_N_GAME];
+	int n_seed;
+} AIPopulation;
+
+/* The training as readers see it, never changed once published */
+typedef struct {
+	int gen;
+	float best_performance;
+	float best_score;
+	float screen_correlation;
+	NNEliteList elites;		/* Copies of the elites, workers produce children from them */
+	SnakeReplay *champion;	/* Best game of the record holder */
+} AISnapshot;
+
+static AIPopulation population;
+/* Next entry of population.eval to evaluate */
+static atomic_int population_next;
+/* Spearman's rank correlation of screening and full performance in the last audited generation, NAN before one */
+static float screen_correlation = NAN;
+
+/*
+ * Workers push their results here and the thread which started them applies them to the elites,
+ * so evaluating never waits for the bookkeeping.
+ */
+static MpscQueue results;
+static sem_t results_ready;
+static atomic_int n_running_worker;
+/* status.best_performance as the workers see it, only the owner of the elites raises it */
+static _Atomic float record_performance;
+/* Children produced by the steady state workers, and how many of them the surrogate skipped */
+static atomic_long n_child;
+static atomic_long n_surrogate_skip;
+
+/* Elites are exchanged with other trainers through it, NULL if training alone */
+static SnakeIsland *island;
+/* Plays the immigrants again, the goodness other islands claim for them is not taken on trust */
+static SnakeEval *island_evaluator;
+
+/* The best game of the current best network, readers get it through the snapshot */
+static SnakeReplay *champion_replay;
+
+/*
+ * The latest snapshot, swapped in whole so readers never take status_lock.
+ * A reader announces the snapshot it holds in its hazard slot, a replaced snapshot
+ * waits in retired_snapshots until no slot holds it.
+ */
+static _Atomic(AISnapshot *) snapshot;
+static _Atomic(AISnapshot *) *snapshot_hazard;
+static int n_snapshot_hazard;
+static atomic_int n_snapshot_reader;
+static _Thread_local int snapshot_reader = -1;	/* Hazard slot, n_snapshot_hazard if none was left */
+static AISnapshot **retired_snapshots;	/* Only touched by the publisher */
+static int n_retired_snapshot;
+static int retired_snapshot_cap;
+
 static pthread_t display_thread;
-/* Prevent the neural network get destroyed during duplication before showcase */
+/*
+ * Status and the champion are only touched by the thread which started the workers, the others read snapshots.
+ * Readers without a hazard slot hold it while they use the snapshot, so the publisher takes it to swap and free them.
+ */
 static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void signal_handler(int sig);
 
 static int parse_opt(int argc, char **argv);
+static int parse_obs_encoder(const char *name, OBS_ENCODER *encoder, int *vision_size);
 
 static int ai_status_init(const char *file_name, AIStatus *status);
 static int ai_status_exit(const char *file_name, AIStatus *status);
+static void _ai_status_read_config(FILE *f, AIStatus *status);
+static int _ai_status_write_config(FILE *f, AIStatus *status);
 
 static void *_display_thread_func(void *arg);
-static int _find_max_in_array(float *arr, int len);
 static void _ai_run_n_games(NeuralNetwork *nn, int n, int demo, float *avg_performance, float *avg_score);
+static void _ai_evaluate(SnakeEval *evaluator, NeuralNetwork *nn, int race, float *performance, float *score);
+static void _ai_show_status(void);
+static void _ai_publish(void);
+static void _ai_snapshot_init(int n_reader);
+static void _ai_snapshot_free(AISnapshot *snap);
+static int _ai_snapshot_is_held(AISnapshot *snap);
+static AISnapshot *_ai_snapshot_acquire(void);
+static void _ai_snapshot_release(void);
+static void _ai_snapshot_cleanup(void);
+static void _ai_show_replay(SnakeReplay *replay, int show_status);
+static void _ai_set_champion(SnakeReplay *replay, int append);
+static void *_ai_worker_func(void *arg);
+static int _ai_record_result(SnakeReplay *best_game, NeuralNetwork *nn, float performance, float score);
+static int _ai_push_result(SnakeEval *evaluator, NeuralNetwork *nn, float performance, float score, int keep_nn);
+static void _ai_worker_exit(void);
+static int _ai_apply_results(void);
+static void _ai_collect_results(void);
+static NeuralNetwork *_ai_produce_from_elites(NNEliteList *elites);
+static void _ai_population_init(AIPopulation *pop, int n);
+static void _ai_population_release(AIPopulation *pop);
+static int _ai_population_select(AIPopulation *pop);
+static void _ai_population_produce(AIPopulation *next, AIPopulation *prev);
+static void *_ai_population_worker_func(void *arg);
+static void _ai_population_run(AIWorker *workers);
+static int _ai_population_promote(AIPopulation *pop, int all);
+static float _ai_rank_correlation(const float *a, const float *b, int n);
+static void _ai_run_generations(AIWorker *workers);
+static void _ai_population_immigrate(AIPopulation *pop, NNEliteList *immigrants);
+static void _ai_migrate(AIPopulation *pop);
 
 static void ai_progress(void);
 static void ai_replay(void);
+static void ai_play(void);
 
 static int
 parse_opt(int argc, char **argv)
 {
 	int c;
-
-	while ((c = getopt(argc, argv, "hrs:f:m:PR")) != -1)
+	static const struct option long_opts[] = {
+		{ "population", required_argument, NULL, OPT_POPULATION },
+		{ "selection", required_argument, NULL, OPT_SELECTION },
+		{ "island-dir", required_argument, NULL, OPT_ISLAND_DIR },
+		{ "island-name", required_argument, NULL, OPT_ISLAND_NAME },
+		{ "migrate", required_argument, NULL, OPT_MIGRATE },
+		{ "no-race", no_argument, NULL, OPT_NO_RACE },
+		{ "screen", required_argument, NULL, OPT_SCREEN },
+		{ "screen-step", required_argument, NULL, OPT_SCREEN_STEP },
+		{ "screen-size", required_argument, NULL, OPT_SCREEN_SIZE },
+		{ "surrogate", no_argument, NULL, OPT_SURROGATE },
+		{ "policy-cache", no_argument, NULL, OPT_POLICY_CACHE },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "hrs:f:m:L:l:p:o:x:y:j:CPR", long_opts, NULL)) != -1)
 	{
 		switch (c)
 		{
@@ -97,6 +371,81 @@ parse_opt(int argc, char **argv)
 			case 'm':
 				param.mutation_rate = atof(optarg);
 				break;
+			case 'L':
+				param.lookahead = atoi(optarg);
+				break;
+			case 'C':
+				param.legacy_food = 1;
+				break;
+			case 'l':
+				param.replay_f = optarg;
+				break;
+			case 'p':
+				param.play_f = optarg;
+				break;
+			case 'o':
+				param.obs_encoder = optarg;
+				break;
+			case 'x':
+				param.size_x = atoi(optarg);
+				break;
+			case 'y':
+				param.size_y = atoi(optarg);
+				break;
+			case 'j':
+				param.n_worker = atoi(optarg);
+				if (param.n_worker < 1)
+					param.n_worker = 1;
+				break;
+			case OPT_POPULATION:
+				param.population = atoi(optarg);
+				/* Selection needs 2 different parents */
+				if (param.population < 2)
+					param.population = 0;
+				break;
+			case OPT_SELECTION:
+				if (strcmp(optarg, "rank") == 0)
+					param.selection = SELECTION_RANK;
+				else
+					param.selection = SELECTION_TOURNAMENT;
+				break;
+			case OPT_ISLAND_DIR:
+				param.island_dir = optarg;
+				break;
+			case OPT_ISLAND_NAME:
+				param.island_name = optarg;
+				break;
+			case OPT_MIGRATE:
+				param.migrate_gen = atoi(optarg);
+				if (param.migrate_gen < 1)
+					param.migrate_gen = 1;
+				break;
+			case OPT_NO_RACE:
+				param.race = 0;
+				break;
+			case OPT_SCREEN:
+				param.screen_fraction = atof(optarg);
+				if (param.screen_fraction < 0 || param.screen_fraction >= 1)
+					param.screen_fraction = 0;
+				break;
+			case OPT_SCREEN_STEP:
+				param.screen_step = atoi(optarg);
+				if (param.screen_step < 1)
+					param.screen_step = 1;
+				break;
+			case OPT_SCREEN_SIZE:
+				if (sscanf(optarg, "%dx%d", &param.screen_size_x, &param.screen_size_y) != 2)
+				{
+					param.screen_size_x = 0;
+					param.screen_size_y = 0;
+				}
+				break;
+			case OPT_SURROGATE:
+				param.surrogate = 1;
+				break;
+			case OPT_POLICY_CACHE:
+				param.policy_cache = 1;
+				break;
 			case 'h':
 			default:
 				/* Print help */
@@ -105,8 +454,26 @@ parse_opt(int argc, char **argv)
 						"    -P progress the training.\n"
 						"    -s <game_seed> for non-random map\n"
 						"    -r for randomized map generation\n"
-						"    -f <file_name> to save file\n",
-						argv[0]);
+						"    -f <file_name> to save file\n"
+						"    -L <steps> look ahead before every move when showing a game\n"
+						"    -C place food and draw numbers the legacy way in a new run, to reproduce games of old seeds\n"
+						"    -l <file_name> to append every record game to\n"
+						"    -p <file_name> play the games of a replay file\n"
+						"    -o <basic|rays|vision<k>> what a new run's networks see, e.g. vision5\n"
+						"    -x <width> -y <height> of a new run's field, up to %d\n"
+						"    -j <n_worker> threads to train with\n"
+						"    --population <n> train by generations of n children instead of one child at a time\n"
+						"    --selection <tournament|rank> how a generation picks parents, tournament by default\n"
+						"    --island-dir <dir> exchange elites with the other trainers using the directory\n"
+						"    --island-name <name> of this trainer in the directory, island-<pid> by default\n"
+						"    --migrate <n> generations between exchanges, %d by default, %d children count as one without --population\n"
+						"    --no-race play the same games with every candidate, hopeless or promising\n"
+						"    --screen <fraction> of a generation which passes a cheap screening game to the full games\n"
+						"    --screen-step <steps> of a screening game, %d by default\n"
+						"    --screen-size <width>x<height> of a screening game, half the field by default\n"
+						"    --surrogate skip children a model learnt from past children expects to fail\n"
+						"    --policy-cache reuse a network's move for an observation it has seen, basic encoder only\n",
+						argv[0], SNAKE_GAME_MAX_SIZE, ISLAND_MIGRATE_GEN, ISLAND_GEN_CHILD, SCREEN_MAX_STEP);
 				exit(0);
 		}
 	}
@@ -114,9 +481,40 @@ parse_opt(int argc, char **argv)
 	return 0;
 }
 
+static int
+parse_obs_encoder(const char *name, OBS_ENCODER *encoder, int *vision_size)
+{
+	if (strcmp(name, "basic") == 0)
+	{
+		*encoder = OBS_ENCODER_BASIC;
+		*vision_size = 0;
+		return 0;
+	}
+
+	if (strcmp(name, "rays") == 0)
+	{
+		*encoder = OBS_ENCODER_RAYS;
+		*vision_size = 0;
+		return 0;
+	}
+
+	if (strncmp(name, "vision", 6) == 0)
+	{
+		*encoder = OBS_ENCODER_VISION;
+		*vision_size = atoi(name + 6);
+		/* The window is centered at the head */
+		if (*vision_size < 1 || (*vision_size & 1) == 0)
+			return -1;
+		return 0;
+	}
+
+	return -1;
+}
+
 static void
 signal_handler(int sig)
 {
+	(void)sig;
 	should_stop = 1;
 }
 
@@ -143,6 +541,8 @@ ai_status_init(const char *file_name, AIStatus *status)
 	if (nn_elites_loadf(&status->elite_list, f))
 		goto __exit;
 
+	_ai_status_read_config(f, status);
+
 	ret = 0;
 __exit:
 	fclose(f);
@@ -172,61 +572,113 @@ ai_status_exit(const char *file_name, AIStatus *status)
 	if (nn_elites_savef(&status->elite_list, f))
 		goto __exit;
 
+	if (_ai_status_write_config(f, status))
+		goto __exit;
+
 	ret = 0;
 __exit:
 	fclose(f);
 	return ret;
 }
 
+static void
+_ai_status_read_config(FILE *f, AIStatus *status)
+{
+	int magic;
+	int version;
+	int food_mode;
+	int obs[2];
+	int size[2];
+	int rng;
+
+	/* Files written before the rules were saved played with legacy food placement and MT19937 */
+	status->food_mode = FOOD_MODE_LEGACY;
+	status->obs_encoder = OBS_ENCODER_BASIC;
+	status->obs_vision_size = 0;
+	status->size_x = GAME_X;
+	status->size_y = GAME_Y;
+	status->rng = SNAKE_RNG_MT;
+
+	if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != AI_STATUS_CONFIG_MAGIC)
+		return;
+
+	if (fread(&version, sizeof(version), 1, f) != 1 || version < 1)
+		return;
+
+	if (fread(&food_mode, sizeof(food_mode), 1, f) != 1)
+		return;
+	status->food_mode = food_mode;
+
+	if (version < 2 || fread(obs, sizeof(obs[0]), 2, f) != 2)
+		return;
+	status->obs_encoder = obs[0];
+	status->obs_vision_size = obs[1];
+
+	if (version < 3 || fread(size, sizeof(size[0]), 2, f) != 2)
+		return;
+	status->size_x = size[0];
+	status->size_y = size[1];
+
+	if (version < 4 || fread(&rng, sizeof(rng), 1, f) != 1)
+		return;
+	status->rng = rng;
+}
+
 static int
-_find_max_in_array(float *arr, int len)
+_ai_status_write_config(FILE *f, AIStatus *status)
 {
-	int i;
-	float f_max = arr[0];
-	int i_max = 0;
+	int magic = AI_STATUS_CONFIG_MAGIC;
+	int version = AI_STATUS_CONFIG_VERSION;
+	int food_mode = status->food_mode;
+	int obs[2] = { status->obs_encoder, status->obs_vision_size };
+	int size[2] = { status->size_x, status->size_y };
+	int rng = status->rng;
+
+	if (fwrite(&magic, sizeof(magic), 1, f) != 1)
+		return -1;
 
-	for (i = 1; i < len; i++)
-	{
-		if (f_max < arr[i])
-		{
-			f_max = arr[i];
-			i_max = i;
-		}
-	}
+	if (fwrite(&version, sizeof(version), 1, f) != 1)
+		return -1;
+
+	if (fwrite(&food_mode, sizeof(food_mode), 1, f) != 1)
+		return -1;
+
+	if (fwrite(obs, sizeof(obs[0]), 2, f) != 2)
+		return -1;
 
-	return i_max;
+	if (fwrite(size, sizeof(size[0]), 2, f) != 2)
+		return -1;
+
+	if (fwrite(&rng, sizeof(rng), 1, f) != 1)
+		return -1;
+
+	return 0;
 }
 
 static void *
 _display_thread_func(void *arg)
 {
-	NeuralNetwork *the_best;
-	NeuralNetwork *nn;
-	int n_elite;
-	float performance;
-	float score;
+	SnakeReplay *replay;
+	AISnapshot *snap;
 
+	(void)arg;
+	replay = snake_replay_create();
 	while (!should_stop)
 	{
-		pthread_mutex_lock(&status_lock);
-		the_best = nn_elites_get_best(&status.elite_list);
-		nn = nn_duplicate(the_best);
-		pthread_mutex_unlock(&status_lock);
-		if (nn == NULL)
+		/* Show the recorded game of the champion, no network runs here */
+		snap = _ai_snapshot_acquire();
+		snake_replay_copy(replay, snap->champion);
+		_ai_snapshot_release();
+		if (replay->n_step == 0)
 		{
 			printf("Waiting for the best to be generated.\n");
 			usleep(1000000);
 			continue;
 		}
 
-		_ai_run_n_games(nn,
-				1,
-				1,
-				&performance,
-				&score);
-
-		nn_free(nn);
+		_ai_show_replay(replay, 1);
 	}
+	snake_replay_free(replay);
 
 	pthread_exit(NULL);
 }
@@ -236,198 +688,1265 @@ _ai_run_n_games(NeuralNetwork *nn, int n, int demo, float *avg_performance, floa
 {
 	int i;
 	SnakeGame *game = NULL;
-	float input[8];
+	SnakeLookahead *la = NULL;
+	NeuralNetwork *folded;
+	float *input;
 	float *output;
 	int dir;
 
+	/* Play with the network the evaluator scored, folding may flip near ties */
+	folded = nn_fold(nn, NULL);
+	if (folded)
+		nn = folded;
+
+	input = malloc(sizeof(float) * snake_game_get_n_observation(&game_config));
+	game = snake_game_create(&game_config, 0);
+	if (param.lookahead > 0)
+		la = snake_lookahead_create(&game_config, param.lookahead);
 	*avg_score = 0;
 	*avg_performance = 0;
 	for (i = 0; i < n; i++)
 	{
-		game = snake_game_create(GAME_X,
-				GAME_Y,
-				8,
-				GAME_MAX_STEP,
-				param.game_rand_map ? rand() : param.game_seed);
+		snake_game_reset(game, param.game_rand_map ? rand() : param.game_seed);
 		if (demo)
 			snake_game_show(game);
 		while (!snake_game_is_over(game) && !should_stop)
 		{
-			input[0] = game->dist_to_hit[0];
-			input[1] = game->dist_to_hit[1];
-			input[2] = game->dist_to_hit[2];
-			input[3] = game->dist_to_hit[3];
-			input[4] = game->dist_to_food[0];
-			input[5] = game->dist_to_food[1];
-			input[6] = game->dist_to_food[2];
-			input[7] = game->dist_to_food[3];
-
-			output = nn_run(nn, input);
-			dir = _find_max_in_array(output, 4);
+			if (la)
+			{
+				dir = snake_lookahead_choose(la, nn, game);
+			}
+			else
+			{
+				snake_game_get_observation(game, input);
+
+				output = nn_run(nn, input);
+				dir = snake_eval_argmax(output, 4);
+			}
 
 			snake_game_set_direction(game, dir, 1);
 			snake_game_update(game, 1, demo ? 1 : 0);
 
 			if (demo)
 			{
-				pthread_mutex_lock(&status_lock);
-				printf("Save file: \"%s\"\n", param.status_f);
-				printf("Mutation rate: %f\n", param.mutation_rate);
-				if (param.game_rand_map)
-					printf("Game seed: Randomized\n");
-				else
-					printf("Game seed: %d\n", param.game_seed);
-
-				printf("Current generation: %d\n", status.gen);
-				printf("Best performance: %.2f\n", status.best_performance);
-				nn_elite_show(&status.elite_list);
-				pthread_mutex_unlock(&status_lock);
+				_ai_show_status();
 				usleep(1000000 / 16);
 			}
 		}
 
 		*avg_score += snake_game_get_score(game);
 		*avg_performance += snake_game_get_performance(game);
-		snake_game_free(game);
 	}
 
+	snake_game_free(game);
+	if (la)
+		snake_lookahead_free(la);
+	if (folded)
+		nn_free(folded);
+	free(input);
+
 	*avg_score /= (float)n;
 	*avg_performance /= (float)n;
 }
 
 static void
-ai_progress(void)
+_ai_show_status(void)
 {
-	NeuralNetwork *best = NULL;
-	NeuralNetwork *nn = NULL;
+	AISnapshot *snap;
+	float goodness;
+	int i;
 
-	float performance;
-	float score;
+	printf("Save file: \"%s\"\n", param.status_f);
+	printf("Mutation rate: %f\n", param.mutation_rate);
+	if (param.game_rand_map)
+		printf("Game seed: Randomized\n");
+	else
+		printf("Game seed: %d\n", param.game_seed);
 
-	pthread_create(&display_thread, NULL, _display_thread_func, NULL);
+	snap = _ai_snapshot_acquire();
+	if (snap)
+	{
+		printf("Current generation: %d\n", snap->gen);
+		printf("Best performance: %.2f\n", snap->best_performance);
+		if (param.screen_fraction > 0 && !isnan(snap->screen_correlation))
+			printf("Screening rank correlation: %.2f\n", snap->screen_correlation);
+		if (param.surrogate && atomic_load(&n_child) > 0)
+			printf("Skipped by the surrogate: %.1f%%\n",
+					100.0f * atomic_load(&n_surrogate_skip) / atomic_load(&n_child));
+		for (i = 0; nn_elites_get_nth(&snap->elites, i, &goodness) != NULL; i++)
+			printf("Elite %d goodness: %6.2f\n", i + 1, goodness);
+	}
+	_ai_snapshot_release();
+}
 
-	while (!should_stop)
+/*
+ * Publish what readers see of the training, only called by the thread which owns status.
+ * The snapshot is built without the lock, it is only held to swap it in and free the old ones.
+ */
+static void
+_ai_publish(void)
+{
+	AISnapshot *snap;
+	AISnapshot *old;
+	NeuralNetwork *nn;
+	float goodness;
+	int i;
+
+	snap = malloc(sizeof(*snap));
+	snap->gen = status.gen;
+	snap->best_performance = status.best_performance;
+	snap->best_score = status.best_score;
+	snap->screen_correlation = screen_correlation;
+	nn_elites_init_list(&snap->elites, status.elite_list.max_len);
+	for (i = 0; (nn = nn_elites_get_nth(&status.elite_list, i, &goodness)) != NULL; i++)
+		nn_elites_add(&snap->elites, nn_duplicate(nn), goodness);
+	snap->champion = snake_replay_create();
+	snake_replay_copy(snap->champion, champion_replay);
+
+	pthread_mutex_lock(&status_lock);
+	old = atomic_exchange(&snapshot, snap);
+	if (old)
 	{
-		pthread_mutex_lock(&status_lock);
-		best = nn_elites_get_best(&status.elite_list);
-		if (best == NULL)
+		if (n_retired_snapshot == retired_snapshot_cap)
 		{
-			nn = nn_create(8,
-					4,
-					2,
-					8,
-					0,
-					ACT_FUNC_TYPE_LINEAR,
-					ACT_FUNC_TYPE_LINEAR);
+			retired_snapshot_cap = retired_snapshot_cap ? retired_snapshot_cap * 2 : 8;
+			retired_snapshots = realloc(retired_snapshots, sizeof(AISnapshot *) * retired_snapshot_cap);
 		}
-		else
+		retired_snapshots[n_retired_snapshot++] = old;
+	}
+
+	/* Readers only ever announce the latest snapshot, so at most one per reader stays */
+	for (i = 0; i < n_retired_snapshot;)
+	{
+		if (_ai_snapshot_is_held(retired_snapshots[i]))
 		{
-			/* produce from elites */
-			NeuralNetwork *parent_a;
-			NeuralNetwork *parent_b;
+			i++;
+			continue;
+		}
+		_ai_snapshot_free(retired_snapshots[i]);
+		retired_snapshots[i] = retired_snapshots[--n_retired_snapshot];
+	}
+	pthread_mutex_unlock(&status_lock);
+}
 
-			/* 1. Choose parents */
-			//parent_a = nn_elites_pick_by_random(&elite_list, NULL);
-			parent_a = best;
-			parent_b = nn_elites_pick_by_random(&status.elite_list, parent_a);
+/* Give every worker and n_reader other threads a hazard slot */
+static void
+_ai_snapshot_init(int n_reader)
+{
+	n_snapshot_hazard = n_reader;
+	snapshot_hazard = calloc(n_reader, sizeof(*snapshot_hazard));
+}
 
-			/* 2. Produce child */
-			nn = nn_produce(parent_a, parent_b);
+static void
+_ai_snapshot_free(AISnapshot *snap)
+{
+	nn_elites_clear(&snap->elites);
+	snake_replay_free(snap->champion);
+	free(snap);
+}
 
-			/* 3. Mutate */
-			nn_randomize_by_rate(nn, param.mutation_rate);
-		}
+static int
+_ai_snapshot_is_held(AISnapshot *snap)
+{
+	int i;
+
+	for (i = 0; i < n_snapshot_hazard; i++)
+	{
+		if (atomic_load(&snapshot_hazard[i]) == snap)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The latest snapshot, it stays valid until _ai_snapshot_release, NULL before the first one */
+static AISnapshot *
+_ai_snapshot_acquire(void)
+{
+	AISnapshot *snap;
+
+	if (snapshot_reader < 0)
+	{
+		snapshot_reader = atomic_fetch_add(&n_snapshot_reader, 1);
+		if (snapshot_reader > n_snapshot_hazard)
+			snapshot_reader = n_snapshot_hazard;
+	}
+
+	/* Out of slots, nothing is published or freed while the lock is held */
+	if (snapshot_reader == n_snapshot_hazard)
+	{
+		pthread_mutex_lock(&status_lock);
+		return atomic_load(&snapshot);
+	}
+
+	/* Announce it, then make sure it was not replaced before the announcement could be seen */
+	do
+	{
+		snap = atomic_load(&snapshot);
+		atomic_store(&snapshot_hazard[snapshot_reader], snap);
+	} while (snap != atomic_load(&snapshot));
+
+	return snap;
+}
+
+static void
+_ai_snapshot_release(void)
+{
+	if (snapshot_reader == n_snapshot_hazard)
 		pthread_mutex_unlock(&status_lock);
+	else
+		atomic_store(&snapshot_hazard[snapshot_reader], NULL);
+}
 
-		_ai_run_n_games(nn,
-				param.game_rand_map ? 10 : 1,
-				0,
-				&performance,
-				&score);
+/* Free every snapshot, once no reader is left */
+static void
+_ai_snapshot_cleanup(void)
+{
+	int i;
 
-		/* Count generation */
-		if (performance > status.best_performance)
-		{
-			best = nn;
-			pthread_mutex_lock(&status_lock);
-			status.gen++;
-			status.best_performance = performance;
-			status.best_score = score;
-			pthread_mutex_unlock(&status_lock);
-		}
+	for (i = 0; i < n_retired_snapshot; i++)
+		_ai_snapshot_free(retired_snapshots[i]);
+	free(retired_snapshots);
+	retired_snapshots = NULL;
+	n_retired_snapshot = 0;
+	retired_snapshot_cap = 0;
+
+	if (atomic_load(&snapshot))
+		_ai_snapshot_free(atomic_exchange(&snapshot, NULL));
+
+	free(snapshot_hazard);
+	snapshot_hazard = NULL;
+	n_snapshot_hazard = 0;
+}
+
+static void
+_ai_show_replay(SnakeReplay *replay, int show_status)
+{
+	SnakeGame *game;
+	int i;
+
+	game = snake_game_create(&replay->config, replay->seed);
+	if (game == NULL)
+	{
+		fprintf(stderr, "Failed to create the game of the replay.\n");
+		return;
+	}
+	snake_game_show(game);
+	for (i = 0; i < replay->n_step && !snake_game_is_over(game) && !should_stop; i++)
+	{
+		/* Recorded directions are the ones the snake really took */
+		snake_game_set_direction(game, snake_replay_get_action(replay, i), 0);
+		snake_game_update(game, 1, 1);
 
-		if (performance > status.best_performance * ELITE_THRESHOLD)
+		if (show_status)
 		{
-			pthread_mutex_lock(&status_lock);
-			nn_elites_add(&status.elite_list, nn, performance);
-			pthread_mutex_unlock(&status_lock);
+			_ai_show_status();
 		}
 		else
 		{
-			nn_free(nn);
+			printf("Replay seed: %d\n", replay->seed);
+			if (replay->gen >= 0)
+				printf("Generation: %d\n", replay->gen);
+			printf("Recorded score: %d, performance: %.2f\n", replay->score, replay->performance);
 		}
+		usleep(1000000 / 16);
 	}
 
-	pthread_join(display_thread, NULL);
+	snake_game_free(game);
 }
 
+/* Only called by the owner of status, so champions are recorded in the order they were found */
 static void
-ai_replay(void)
+_ai_set_champion(SnakeReplay *replay, int append)
 {
-	NeuralNetwork *the_best = NULL;
-	NeuralNetwork *nn = NULL;
-	float performance;
-	float score = 0;
+	snake_replay_copy(champion_replay, replay);
+	champion_replay->gen = status.gen;
 
-	the_best = nn_elites_get_best(&status.elite_list);
-	nn = nn_duplicate(the_best);
-	if (nn == NULL)
+	if (append && snake_replay_append(champion_replay, param.replay_f))
+		fprintf(stderr, "Failed to append the record game to \"%s\".\n", param.replay_f);
+}
+
+/* With race set, a candidate which cannot make it to the elites stops early and one which can plays more */
+static void
+_ai_evaluate(SnakeEval *evaluator, NeuralNetwork *nn, int race, float *performance, float *score)
+{
+	int seeds[GAME_RANDOM_MAP_N_GAME + GAME_RANDOM_MAP_N_EXTRA];
+	int n;
+	int n_extra;
+	int i;
+
+	n = param.game_rand_map ? GAME_RANDOM_MAP_N_GAME : 1;
+	n_extra = param.game_rand_map && race && param.race ? GAME_RANDOM_MAP_N_EXTRA : 0;
+	for (i = 0; i < n + n_extra; i++)
+		seeds[i] = param.game_rand_map ? rand() : param.game_seed;
+
+	/* All games of this candidate are stepped together */
+	if (race && param.race)
 	{
-		printf("Failed to load.\n");
-		return;
+		/* The record only rises, so a candidate below the threshold now stays below it */
+		snake_eval_race(evaluator,
+				nn,
+				seeds,
+				n,
+				n_extra,
+				atomic_load_explicit(&record_performance, memory_order_relaxed) * ELITE_THRESHOLD,
+				performance,
+				score);
+	}
+	else
+	{
+		snake_eval_run(evaluator, nn, seeds, n, performance, score);
 	}
+}
 
-	_ai_run_n_games(nn,
-			1,
-			1,
-			&performance,
-			&score);
+/* Produce a child of the best and a random one of elites, which nobody may change meanwhile */
+static NeuralNetwork *
+_ai_produce_from_elites(NNEliteList *elites)
+{
+	NeuralNetwork *best;
+	NeuralNetwork *nn;
 
-	nn_free(nn);
+	best = nn_elites_get_best(elites);
+	if (best == NULL)
+	{
+		nn = nn_create(snake_game_get_n_observation(&game_config),
+				4,
+				2,
+				8,
+				0,
+				ACT_FUNC_TYPE_LINEAR,
+				ACT_FUNC_TYPE_LINEAR);
+	}
+	else
+	{
+		/* produce from elites */
+		NeuralNetwork *parent_a;
+		NeuralNetwork *parent_b;
+
+		/* 1. Choose parents */
+		//parent_a = nn_elites_pick_by_random(&elite_list, NULL);
+		parent_a = best;
+		parent_b = nn_elites_pick_by_random(elites, parent_a);
+
+		/* 2. Produce child */
+		nn = nn_produce(parent_a, parent_b);
+
+		/* 3. Mutate */
+		nn_randomize_by_rate(nn, param.mutation_rate);
+	}
+
+	return nn;
 }
 
-int main(int argc, char **argv)
+/*
+ * Record the result of an evaluated network, only called by the owner of status.
+ * The network is handed to the elites if it is good enough, returns 1 if the elites took it.
+ */
+static int
+_ai_record_result(SnakeReplay *best_game, NeuralNetwork *nn, float performance, float score)
 {
-	/* Init */
-	srand(time(NULL));
+	/* Count generation */
+	if (performance > status.best_performance)
+	{
+		/* The generational mode counts generations instead */
+		if (param.population == 0)
+			status.gen++;
+		status.best_performance = performance;
+		status.best_score = score;
+		atomic_store(&record_performance, performance);
 
-	signal(SIGINT, signal_handler);
+		_ai_set_champion(best_game, 1);
+	}
 
-	if (argc < 2)
+	if (performance <= status.best_performance * ELITE_THRESHOLD)
 		return 0;
 
-	parse_opt(argc, argv);
+	nn_elites_add(&status.elite_list, nn, performance);
+	return 1;
+}
 
-	if (ai_status_init(param.status_f, &status))
+/*
+ * Queue the result of an evaluated network for the owner of the elites, never blocks.
+ * The network is handed over, or a copy of it if keep_nn is set, returns 1 if it was queued.
+ * Results which can neither set a record nor become elites are not queued at all.
+ */
+static int
+_ai_push_result(SnakeEval *evaluator, NeuralNetwork *nn, float performance, float score, int keep_nn)
+{
+	AIResult *result;
+	float record;
+
+	/* The record only rises, so what is too bad for it now stays too bad */
+	record = atomic_load_explicit(&record_performance, memory_order_relaxed);
+	if (performance <= record && performance <= record * ELITE_THRESHOLD)
+		return 0;
+
+	result = malloc(sizeof(*result));
+	result->nn = keep_nn ? nn_duplicate(nn) : nn;
+	result->performance = performance;
+	result->score = score;
+	result->replay = NULL;
+
+	/* The best game only lives in the evaluator until its next run */
+	if (performance > record)
 	{
-		/* Initialize everything */
-		status.gen = 0;
-		status.best_performance = 0;
-		status.best_score = 0;
-		nn_elites_init_list(&status.elite_list, 10);
+		result->replay = snake_replay_create();
+		snake_replay_copy(result->replay, evaluator->replays[evaluator->best_game]);
 	}
 
-	if (param.progress)
+	mpsc_queue_push(&results, &result->node);
+	sem_post(&results_ready);
+	return 1;
+}
+
+/* Called by a worker when it is done, wakes the owner so it notices */
+static void
+_ai_worker_exit(void)
+{
+	atomic_fetch_sub(&n_running_worker, 1);
+	sem_post(&results_ready);
+}
+
+/* Apply every queued result in one batch, only called by the thread which started the workers */
+static int
+_ai_apply_results(void)
+{
+	MpscNode *node;
+	AIResult *result;
+	int n;
+
+	n = 0;
+	while ((node = mpsc_queue_pop(&results)) != NULL)
 	{
-		ai_progress();
-		ai_status_exit(param.status_f, &status);
+		result = (AIResult *)node;
+		if (!_ai_record_result(result->replay, result->nn, result->performance, result->score))
+			nn_free(result->nn);
+		if (result->replay)
+			snake_replay_free(result->replay);
+		free(result);
+		n++;
+	}
+	if (n)
+		_ai_publish();
+
+	return n;
+}
+
+/*
+ * Apply results as they come until every worker is done, the caller joins them afterwards.
+ * Islands migrate by the children made, records may not come for long.
+ */
+static void
+_ai_collect_results(void)
+{
+	struct timespec deadline;
+	long next_migration;
+
+	next_migration = (long)param.migrate_gen * ISLAND_GEN_CHILD;
+	while (atomic_load(&n_running_worker) > 0)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		sem_timedwait(&results_ready, &deadline);
+		_ai_apply_results();
+
+		/* Generations migrate on their own */
+		if (param.population == 0 && atomic_load(&n_child) >= next_migration)
+		{
+			_ai_migrate(NULL);
+			next_migration = atomic_load(&n_child) + (long)param.migrate_gen * ISLAND_GEN_CHILD;
+		}
+	}
+
+	/* Whatever was pushed before the last worker left */
+	_ai_apply_results();
+}
+
+static void *
+_ai_worker_func(void *arg)
+{
+	AIWorker *worker = arg;
+	AISnapshot *snap;
+	NeuralNetwork *nn = NULL;
+	NeuralNetwork *best;
+	int bred;			/* The child comes from the best, so the surrogate can judge it */
+	float features[SNAKE_SURROGATE_N_FEATURE];
+	float record;
+
+	float performance;
+	float score;
+
+	while (!should_stop)
+	{
+		/* The elites of the snapshot stay as they are while it is held, whatever the owner does to its own */
+		snap = _ai_snapshot_acquire();
+		best = nn_elites_get_best(&snap->elites);
+		nn = _ai_produce_from_elites(&snap->elites);
+		bred = best != NULL;
+		if (worker->surrogate && bred)
+			snake_surrogate_features(nn, best, features);
+		_ai_snapshot_release();
+		atomic_fetch_add(&n_child, 1);
+
+		/* Children of the best which the surrogate gives up on are not worth the games */
+		if (worker->surrogate && bred &&
+			worker->surrogate->n_sample >= SURROGATE_WARMUP &&
+			snake_surrogate_predict(worker->surrogate, features) < ELITE_THRESHOLD * SURROGATE_SKIP_RATIO &&
+			rand() % SURROGATE_EXPLORE)
+		{
+			atomic_fetch_add(&n_surrogate_skip, 1);
+			nn_free(nn);
+			continue;
+		}
+
+		/* The child is only known to this worker until it is queued */
+		_ai_evaluate(worker->evaluator, nn, 1, &performance, &score);
+
+		record = atomic_load_explicit(&record_performance, memory_order_relaxed);
+		if (worker->surrogate && bred && record > 0)
+			snake_surrogate_train(worker->surrogate, features, performance / record);
+
+		if (!_ai_push_result(worker->evaluator, nn, performance, score, 0))
+			nn_free(nn);
+	}
+
+	_ai_worker_exit();
+	return NULL;
+}
+
+static void
+_ai_population_init(AIPopulation *pop, int n)
+{
+	int i;
+
+	pop->n = n;
+	pop->nn = malloc(sizeof(NeuralNetwork *) * n);
+	for (i = 0; i < n; i++)
+		pop->nn[i] = NULL;
+	pop->performance = malloc(sizeof(float) * n);
+	pop->rank = malloc(sizeof(int) * n);
+	pop->eval = malloc(sizeof(int) * n);
+	pop->n_eval = 0;
+	pop->screening = 0;
+	pop->screen = malloc(sizeof(float) * n);
+	pop->screen_seed = 0;
+	pop->n_seed = 0;
+}
+
+static void
+_ai_population_release(AIPopulation *pop)
+{
+	int i;
+
+	for (i = 0; i < pop->n; i++)
+	{
+		if (pop->nn[i])
+			nn_free(pop->nn[i]);
+	}
+	free(pop->nn);
+	free(pop->performance);
+	free(pop->rank);
+	free(pop->eval);
+	free(pop->screen);
+}
+
+static int
+_ai_population_select(AIPopulation *pop)
+{
+	int i;
+	int pick;
+	int total;
+
+	if (param.selection == SELECTION_RANK)
+	{
+		/* The child of rank r (0 is the best) has a weight of n - r */
+		total = pop->n * (pop->n + 1) / 2;
+		pick = rand() % total;
+		for (i = 0; i < pop->n - 1; i++)
+		{
+			pick -= pop->n - i;
+			if (pick < 0)
+				break;
+		}
+		return pop->rank[i];
+	}
+
+	/* The best of a few random children */
+	pick = rand() % pop->n;
+	for (i = 1; i < TOURNAMENT_SIZE; i++)
+	{
+		int c = rand() % pop->n;
+		if (pop->performance[c] > pop->performance[pick])
+			pick = c;
+	}
+	return pick;
+}
+
+static void
+_ai_population_produce(AIPopulation *next, AIPopulation *prev)
+{
+	int i;
+	int j;
+	int a;
+	int b;
+	int tmp;
+
+	/* The first generation comes from the elites, or is random for a new run */
+	if (prev->nn[0] == NULL)
+	{
+		for (i = 0; i < next->n; i++)
+			next->nn[i] = _ai_produce_from_elites(&status.elite_list);
+		return;
+	}
+
+	/* Rank the last generation, insertion sort is fine for a generation */
+	for (i = 0; i < prev->n; i++)
+	{
+		tmp = i;
+		for (j = i; j > 0 && prev->performance[prev->rank[j - 1]] < prev->performance[tmp]; j--)
+			prev->rank[j] = prev->rank[j - 1];
+		prev->rank[j] = tmp;
+	}
+
+	/* The best children go on unchanged so a generation never loses what it found */
+	for (i = 0; i < next->n / POPULATION_ELITISM_RATIO + 1; i++)
+		next->nn[i] = nn_duplicate(prev->nn[prev->rank[i]]);
+
+	for (; i < next->n; i++)
+	{
+		a = _ai_population_select(prev);
+		do
+		{
+			b = _ai_population_select(prev);
+		} while (b == a);
+
+		next->nn[i] = nn_produce(prev->nn[a], prev->nn[b]);
+		nn_randomize_by_rate(next->nn[i], param.mutation_rate);
+	}
+}
+
+static void *
+_ai_population_worker_func(void *arg)
+{
+	AIWorker *worker = arg;
+	float performance;
+	float score;
+	int i;
+
+	while (!should_stop)
+	{
+		i = atomic_fetch_add(&population_next, 1);
+		if (i >= population.n_eval)
+			break;
+		i = population.eval[i];
+
+		if (population.screening)
+		{
+			snake_eval_run(worker->screener,
+					population.nn[i],
+					&population.screen_seed,
+					1,
+					&performance,
+					&score);
+			population.screen[i] = performance;
+			continue;
+		}
+
+		snake_eval_run(worker->evaluator,
+				population.nn[i],
+				population.seeds,
+				population.n_seed,
+				&performance,
+				&score);
+		population.performance[i] = performance;
+
+		/* The child stays in the population, the elites get a copy */
+		_ai_push_result(worker->evaluator, population.nn[i], performance, score, 1);
+	}
+
+	_ai_worker_exit();
+	return NULL;
+}
+
+/* Evaluate population.eval on all workers */
+static void
+_ai_population_run(AIWorker *workers)
+{
+	int i;
+
+	atomic_store(&population_next, 0);
+	atomic_store(&n_running_worker, param.n_worker);
+	for (i = 0; i < param.n_worker; i++)
+		pthread_create(&workers[i].thread, NULL, _ai_population_worker_func, &workers[i]);
+	_ai_collect_results();
+	for (i = 0; i < param.n_worker; i++)
+		pthread_join(workers[i].thread, NULL);
+}
+
+/*
+ * Pick the children which go on from screening to the full games, or all of them if all is set.
+ * The carried over children always go on, the rest by their screening performance.
+ * Children left out rank below every evaluated one, in their screening order.
+ * Returns the number of children promoted.
+ */
+static int
+_ai_population_promote(AIPopulation *pop, int all)
+{
+	int n_keep;
+	int n_promote;
+	float max;
+	int i;
+	int j;
+	int tmp;
+
+	n_keep = pop->n / POPULATION_ELITISM_RATIO + 1;
+	if (n_keep > pop->n)
+		n_keep = pop->n;
+
+	/* Insertion sort is fine for a generation */
+	for (i = 0; i < pop->n; i++)
+	{
+		if (i < n_keep)
+		{
+			pop->eval[i] = i;
+			continue;
+		}
+
+		tmp = i;
+		for (j = i; j > n_keep && pop->screen[pop->eval[j - 1]] < pop->screen[tmp]; j--)
+			pop->eval[j] = pop->eval[j - 1];
+		pop->eval[j] = tmp;
+	}
+
+	n_promote = all ? pop->n : (int)ceilf(param.screen_fraction * pop->n);
+	if (n_promote < n_keep)
+		n_promote = n_keep;
+
+	max = pop->screen[0];
+	for (i = 1; i < pop->n; i++)
+	{
+		if (pop->screen[i] > max)
+			max = pop->screen[i];
+	}
+	for (i = n_promote; i < pop->n; i++)
+		pop->performance[pop->eval[i]] = pop->screen[pop->eval[i]] - max - 1;
+
+	pop->n_eval = n_promote;
+	return n_promote;
+}
+
+/* Spearman's rank correlation, ties share their average rank */
+static float
+_ai_rank_correlation(const float *a, const float *b, int n)
+{
+	float *rank_a;
+	float *rank_b;
+	float mean;
+	float cov;
+	float var_a;
+	float var_b;
+	int i;
+	int j;
+
+	rank_a = malloc(sizeof(float) * n);
+	rank_b = malloc(sizeof(float) * n);
+	for (i = 0; i < n; i++)
+	{
+		rank_a[i] = 0;
+		rank_b[i] = 0;
+		for (j = 0; j < n; j++)
+		{
+			rank_a[i] += a[j] < a[i] ? 1 : (a[j] == a[i] ? 0.5f : 0);
+			rank_b[i] += b[j] < b[i] ? 1 : (b[j] == b[i] ? 0.5f : 0);
+		}
+	}
+
+	/* Ranks run from 0.5 to n - 0.5, so both lists average n / 2 */
+	mean = n / 2.0f;
+	cov = 0;
+	var_a = 0;
+	var_b = 0;
+	for (i = 0; i < n; i++)
+	{
+		cov += (rank_a[i] - mean) * (rank_b[i] - mean);
+		var_a += (rank_a[i] - mean) * (rank_a[i] - mean);
+		var_b += (rank_b[i] - mean) * (rank_b[i] - mean);
+	}
+
+	free(rank_a);
+	free(rank_b);
+
+	if (var_a == 0 || var_b == 0)
+		return 0;
+	return cov / sqrtf(var_a * var_b);
+}
+
+static void
+_ai_run_generations(AIWorker *workers)
+{
+	AIPopulation prev;
+	AIPopulation tmp;
+	int audit;
+	int migrate;
+	int i;
+
+	_ai_population_init(&population, param.population);
+	_ai_population_init(&prev, param.population);
+
+	while (!should_stop)
+	{
+		/* 1. Produce a whole generation from the last one */
+		_ai_population_produce(&population, &prev);
+		for (i = 0; i < prev.n && prev.nn[i]; i++)
+		{
+			nn_free(prev.nn[i]);
+			prev.nn[i] = NULL;
+		}
+
+		/* 2. Screen it on the cheap proxy, then evaluate the promising children on all workers */
+		population.n_seed = param.game_rand_map ? GAME_RANDOM_MAP_N_GAME : 1;
+		for (i = 0; i < population.n_seed; i++)
+			population.seeds[i] = param.game_rand_map ? rand() : param.game_seed;
+
+		audit = 0;
+		if (param.screen_fraction > 0)
+		{
+			population.screen_seed = param.game_rand_map ? rand() : param.game_seed;
+			for (i = 0; i < population.n; i++)
+				population.eval[i] = i;
+			population.n_eval = population.n;
+			population.screening = 1;
+			_ai_population_run(workers);
+			if (should_stop)
+				break;
+
+			/* Now and then every child plays the full games too, to see if screening ranks them right */
+			audit = status.gen % SCREEN_AUDIT_GEN == 0;
+			_ai_population_promote(&population, audit);
+		}
+		else
+		{
+			for (i = 0; i < population.n; i++)
+				population.eval[i] = i;
+			population.n_eval = population.n;
+		}
+
+		population.screening = 0;
+		_ai_population_run(workers);
+
+		if (should_stop)
+			break;
+
+		if (audit)
+			screen_correlation = _ai_rank_correlation(population.screen, population.performance, population.n);
+		status.gen++;
+		migrate = status.gen % param.migrate_gen == 0;
+		_ai_publish();
+
+		/* Immigrants take the place of the worst children, so they can be parents of the next generation */
+		if (migrate)
+			_ai_migrate(&population);
+
+		/* 3. The evaluated generation is the parents of the next one */
+		tmp = prev;
+		prev = population;
+		population = tmp;
+	}
+
+	_ai_population_release(&population);
+	_ai_population_release(&prev);
+}
+
+/*
+ * The immigrants replace the worst children of an evaluated generation, the carried over ones stay.
+ * Their goodness has to come from the generation's own games.
+ */
+static void
+_ai_population_immigrate(AIPopulation *pop, NNEliteList *immigrants)
+{
+	NeuralNetwork *nn;
+	float goodness;
+	int n_keep;
+	int slot;
+	int worst;
+	int i;
+	int j;
+
+	n_keep = pop->n / POPULATION_ELITISM_RATIO + 1;
+	for (i = 0; n_keep + i < pop->n && (nn = nn_elites_get_nth(immigrants, i, &goodness)) != NULL; i++)
+	{
+		/* Slots before this one hold the immigrants placed already */
+		slot = n_keep + i;
+		worst = slot;
+		for (j = slot + 1; j < pop->n; j++)
+		{
+			if (pop->performance[j] < pop->performance[worst])
+				worst = j;
+		}
+
+		/* The worst child leaves, the one in the slot moves to its place and the immigrant takes the slot */
+		nn_free(pop->nn[worst]);
+		pop->nn[worst] = pop->nn[slot];
+		pop->performance[worst] = pop->performance[slot];
+		pop->nn[slot] = nn_duplicate(nn);
+		pop->performance[slot] = goodness;
+	}
+}
+
+/*
+ * Publish the best elites and take the ones of the other islands, only called by the owner of status.
+ * Every immigrant is played here first and goes on with the goodness it earned,
+ * on the games of pop if it is given, the immigrants then also join pop.
+ */
+static void
+_ai_migrate(AIPopulation *pop)
+{
+	NNEliteList emigrants;
+	NNEliteList immigrants;
+	NNEliteList checked;
+	NeuralNetwork *nn;
+	float goodness;
+	float score;
+	int i;
+
+	if (island == NULL)
+		return;
+
+	nn_elites_init_list(&emigrants, island->n_migrant);
+	for (i = 0; i < island->n_migrant && (nn = nn_elites_get_nth(&status.elite_list, i, &goodness)) != NULL; i++)
+		nn_elites_add(&emigrants, nn_duplicate(nn), goodness);
+
+	if (snake_island_export(island, &emigrants))
+		fprintf(stderr, "Failed to publish the elites to \"%s\".\n", param.island_dir);
+	nn_elites_clear(&emigrants);
+
+	nn_elites_init_list(&immigrants, status.elite_list.max_len);
+	snake_island_import(island,
+			&immigrants,
+			snake_game_get_n_observation(&game_config),
+			4);
+
+	nn_elites_init_list(&checked, status.elite_list.max_len);
+	while ((nn = nn_elites_pop(&immigrants, &goodness)) != NULL)
+	{
+		if (pop)
+			snake_eval_run(island_evaluator, nn, pop->seeds, pop->n_seed, &goodness, &score);
+		else
+			_ai_evaluate(island_evaluator, nn, 0, &goodness, &score);
+		nn_elites_add(&checked, nn, goodness);
+	}
+	if (pop)
+		_ai_population_immigrate(pop, &checked);
+
+	snake_island_merge(&status.elite_list, &checked);
+	nn_elites_clear(&immigrants);
+	nn_elites_clear(&checked);
+}
+
+static void
+ai_progress(void)
+{
+	AIWorker *workers;
+	NeuralNetwork *best = NULL;
+	float performance;
+	float score;
+	long cache_lookup;
+	long cache_hit;
+	long race_played;
+	long race_full;
+	int i;
+
+	mpsc_queue_init(&results);
+	sem_init(&results_ready, 0, 0);
+	atomic_store(&record_performance, status.best_performance);
+
+	workers = malloc(sizeof(AIWorker) * param.n_worker);
+	for (i = 0; i < param.n_worker; i++)
+	{
+		workers[i].evaluator = snake_eval_create(&game_config, GAME_RANDOM_MAP_N_GAME + GAME_RANDOM_MAP_N_EXTRA);
+		workers[i].evaluator->stop = &should_stop;
+		workers[i].screener = NULL;
+		workers[i].surrogate = param.surrogate ? snake_surrogate_create() : NULL;
+		if (param.population > 0 && param.screen_fraction > 0)
+		{
+			workers[i].screener = snake_eval_create(&screen_config, 1);
+			workers[i].screener->stop = &should_stop;
+		}
+		if (param.policy_cache)
+		{
+			if (snake_eval_set_cache(workers[i].evaluator, POLICY_CACHE_SLOT) ||
+				(workers[i].screener && snake_eval_set_cache(workers[i].screener, POLICY_CACHE_SLOT)))
+			{
+				printf("The policy cache only works with the basic encoder.\n");
+				param.policy_cache = 0;
+			}
+		}
+	}
+
+	if (island)
+	{
+		island_evaluator = snake_eval_create(&game_config, GAME_RANDOM_MAP_N_GAME);
+		island_evaluator->stop = &should_stop;
+	}
+
+	/* A resumed run records its best once so there is something to show */
+	best = nn_elites_get_best(&status.elite_list);
+	if (best)
+	{
+		_ai_evaluate(workers[0].evaluator, best, 0, &performance, &score);
+		_ai_set_champion(workers[0].evaluator->replays[workers[0].evaluator->best_game], 0);
+	}
+	_ai_publish();
+
+	pthread_create(&display_thread, NULL, _display_thread_func, NULL);
+
+	if (param.population > 0)
+	{
+		_ai_run_generations(workers);
+	}
+	else
+	{
+		atomic_store(&n_running_worker, param.n_worker);
+		for (i = 0; i < param.n_worker; i++)
+			pthread_create(&workers[i].thread, NULL, _ai_worker_func, &workers[i]);
+		_ai_collect_results();
+
+		for (i = 0; i < param.n_worker; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	pthread_join(display_thread, NULL);
+
+	/* The workers are done, their counters can be read */
+	cache_lookup = 0;
+	cache_hit = 0;
+	race_played = 0;
+	race_full = 0;
+	for (i = 0; i < param.n_worker; i++)
+	{
+		race_played += workers[i].evaluator->race_played;
+		race_full += workers[i].evaluator->race_full;
+		cache_lookup += workers[i].evaluator->cache_lookup;
+		cache_hit += workers[i].evaluator->cache_hit;
+		if (workers[i].screener)
+		{
+			cache_lookup += workers[i].screener->cache_lookup;
+			cache_hit += workers[i].screener->cache_hit;
+		}
+	}
+	if (param.policy_cache && cache_lookup > 0)
+		printf("Policy cache hit rate: %.1f%%\n", 100.0 * cache_hit / cache_lookup);
+	if (race_full > 0)
+		printf("Racing played %.1f%% of the games of full evaluation\n", 100.0 * race_played / race_full);
+
+	for (i = 0; i < param.n_worker; i++)
+	{
+		snake_eval_free(workers[i].evaluator);
+		if (workers[i].screener)
+			snake_eval_free(workers[i].screener);
+		if (workers[i].surrogate)
+			snake_surrogate_free(workers[i].surrogate);
+	}
+	free(workers);
+	if (island_evaluator)
+		snake_eval_free(island_evaluator);
+	sem_destroy(&results_ready);
+}
+
+static void
+ai_play(void)
+{
+	SnakeReplay *replay;
+	FILE *f;
+	int version;
+
+	f = fopen(param.play_f, "rb");
+	if (f == NULL || (version = snake_replay_check_header(f)) < 0)
+	{
+		printf("Failed to load.\n");
+		if (f)
+			fclose(f);
+		return;
+	}
+
+	replay = snake_replay_create();
+	while (!should_stop && snake_replay_loadf(replay, f, version) == 0)
+		_ai_show_replay(replay, 0);
+
+	snake_replay_free(replay);
+	fclose(f);
+}
+
+static void
+ai_replay(void)
+{
+	NeuralNetwork *the_best = NULL;
+	NeuralNetwork *nn = NULL;
+	float performance;
+	float score = 0;
+
+	the_best = nn_elites_get_best(&status.elite_list);
+	nn = nn_duplicate(the_best);
+	if (nn == NULL)
+	{
+		printf("Failed to load.\n");
+		return;
+	}
+	_ai_publish();
+
+	_ai_run_n_games(nn,
+			1,
+			1,
+			&performance,
+			&score);
+
+	nn_free(nn);
+}
+
+int main(int argc, char **argv)
+{
+	/* Init */
+	srand(time(NULL));
+
+	signal(SIGINT, signal_handler);
+
+	if (argc < 2)
+		return 0;
+
+	parse_opt(argc, argv);
+
+	/* Screening ranks the children of a generation, steady state training has none to rank */
+	if (param.progress && param.population == 0 &&
+		(param.screen_fraction > 0 || param.screen_step != SCREEN_MAX_STEP || param.screen_size_x > 0))
+	{
+		printf("--screen, --screen-step and --screen-size only work with --population.\n");
+		return 0;
+	}
+	if (param.progress && param.screen_fraction == 0 && (param.screen_step != SCREEN_MAX_STEP || param.screen_size_x > 0))
+	{
+		printf("--screen-step and --screen-size only work with --screen.\n");
+		return 0;
+	}
+	/* The surrogate judges steady state children by their parent, generations are evaluated whole */
+	if (param.progress && param.surrogate && param.population > 0)
+	{
+		printf("--surrogate only works without --population.\n");
+		return 0;
+	}
+
+	if (ai_status_init(param.status_f, &status))
+	{
+		/* Initialize everything */
+		status.gen = 0;
+		status.best_performance = 0;
+		status.best_score = 0;
+		nn_elites_init_list(&status.elite_list, 10);
+		status.food_mode = FOOD_MODE_FREE_CELL;
+		status.obs_encoder = OBS_ENCODER_BASIC;
+		status.obs_vision_size = 0;
+		status.size_x = param.size_x;
+		status.size_y = param.size_y;
+		status.rng = SNAKE_RNG_XOSHIRO;
+		if (param.legacy_food)
+		{
+			status.food_mode = FOOD_MODE_LEGACY;
+			status.rng = SNAKE_RNG_MT;
+		}
+		if (param.obs_encoder &&
+			parse_obs_encoder(param.obs_encoder, &status.obs_encoder, &status.obs_vision_size))
+		{
+			printf("Unknown observation encoder \"%s\".\n", param.obs_encoder);
+			return 0;
+		}
+	}
+	else if (param.legacy_food && (status.food_mode != FOOD_MODE_LEGACY || status.rng != SNAKE_RNG_MT))
+	{
+		/* The elites and the record were earned under the saved rules */
+		printf("\"%s\" was trained with other rules, -C only applies to new runs.\n", param.status_f);
+		nn_elites_clear(&status.elite_list);
+		return 0;
+	}
+
+	if (param.mutation_rate < 0)
+		param.mutation_rate = param.population > 0 ? POPULATION_MUTATION_RATE : MUTATION_RATE;
+
+	game_config.food_mode = status.food_mode;
+	game_config.obs_encoder = status.obs_encoder;
+	game_config.obs_vision_size = status.obs_vision_size;
+	game_config.size_x = status.size_x;
+	game_config.size_y = status.size_y;
+	game_config.rng = status.rng;
+	if (status.size_x < 1 || status.size_y < 1 ||
+		status.size_x > SNAKE_GAME_MAX_SIZE || status.size_y > SNAKE_GAME_MAX_SIZE)
+	{
+		printf("The field must be from 1x1 to %dx%d.\n", SNAKE_GAME_MAX_SIZE, SNAKE_GAME_MAX_SIZE);
+		nn_elites_clear(&status.elite_list);
+		return 0;
+	}
+
+	/* Screening plays shorter games on a smaller field with the same rules */
+	screen_config = game_config;
+	screen_config.max_step = param.screen_step;
+	screen_config.size_x = param.screen_size_x > 0 ? param.screen_size_x : (game_config.size_x + 1) / 2;
+	screen_config.size_y = param.screen_size_y > 0 ? param.screen_size_y : (game_config.size_y + 1) / 2;
+	if (screen_config.size_x > SNAKE_GAME_MAX_SIZE || screen_config.size_y > SNAKE_GAME_MAX_SIZE)
+	{
+		printf("The screening field must be from 1x1 to %dx%d.\n", SNAKE_GAME_MAX_SIZE, SNAKE_GAME_MAX_SIZE);
+		nn_elites_clear(&status.elite_list);
+		return 0;
+	}
+
+	/* The networks only fit the encoder they were trained with */
+	if (nn_elites_get_best(&status.elite_list) &&
+		nn_elites_get_best(&status.elite_list)->n_input != snake_game_get_n_observation(&game_config))
+	{
+		printf("\"%s\" was trained with another observation encoder.\n", param.status_f);
+		nn_elites_clear(&status.elite_list);
+		return 0;
+	}
+
+	champion_replay = snake_replay_create();
+	_ai_snapshot_init(AI_SNAPSHOT_MAX_READER + param.n_worker);
+
+	if (param.play_f)
+	{
+		ai_play();
+	}
+	else if (param.progress)
+	{
+		if (param.island_dir)
+		{
+			char default_name[SNAKE_ISLAND_NAME_LEN];
+			const char *island_name;
+
+			snprintf(default_name, sizeof(default_name), "island-%d", (int)getpid());
+			island_name = param.island_name ? param.island_name : default_name;
+
+			island = snake_island_create(param.island_dir, island_name, ISLAND_N_MIGRANT);
+			if (island == NULL)
+			{
+				printf("Invalid island name \"%s\".\n", island_name);
+				_ai_snapshot_cleanup();
+				nn_elites_clear(&status.elite_list);
+				snake_replay_free(champion_replay);
+				return 0;
+			}
+		}
+
+		ai_progress();
+		ai_status_exit(param.status_f, &status);
+
+		if (island)
+			snake_island_free(island);
 	}
 	else if (param.replay)
 	{
 		ai_replay();
 	}
 
+	_ai_snapshot_cleanup();
 	nn_elites_clear(&status.elite_list);
+	snake_replay_free(champion_replay);
 
 	return 0;
 }
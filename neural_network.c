@@ -13,6 +13,14 @@ static float nn_gen_random_zero_to_one();
 
 static int nn_compute_n_weight(NeuralNetwork *nn);
 
+static NeuralNetwork *nn_alloc(int n_input,
+		int n_output,
+		int n_hidden,
+		int n_neuro_per_hidden,
+		int use_bias,
+		ACT_FUNC_TYPE act_func_type_hidden,
+		ACT_FUNC_TYPE act_func_type_output);
+
 static void nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 		int use_bias,
 		float *input,
@@ -22,8 +30,62 @@ static void nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 		float *bias,
 		float *weight);
 
+static void nn_forward_propagation_batch(ACT_FUNC_TYPE act_func_type,
+		int use_bias,
+		float *input,
+		int n_input,
+		float *output,
+		int n_output,
+		float *bias,
+		float *weight,
+		int packed,
+		int n_batch);
+
+static void nn_forward_propagation_packed(ACT_FUNC_TYPE act_func_type,
+		int use_bias,
+		float *input,
+		int n_input,
+		float *output,
+		int n_output,
+		float *bias,
+		float *packed);
+
+static int nn_panel_width(int n_output);
+
+static int nn_n_panel_row(int n_output);
+
+
+static float *nn_forward(NeuralNetwork *nn, float *input, int packed, float *output);
+
+static float *nn_backward(NeuralNetwork *nn,
+		float *input,
+		float *expect,
+		float rate,
+		float *output,
+		float *delta,
+		float *grad_weight,
+		float *grad_bias);
+
+static float nn_act_func(ACT_FUNC_TYPE act_func_type, float x);
+
 static void nn_correct(float *weight, float *delta, float *input, int n_input, int n_output, float rate);
 
+static void nn_back_propagation(float *restrict weight,
+		float *restrict next_delta,
+		int n_next_output,
+		float *restrict delta,
+		float *restrict output,
+		int n_output,
+		float rate);
+
+static void nn_back_propagation_gradient(float *restrict weight,
+		float *restrict grad,
+		float *restrict next_delta,
+		int n_next_output,
+		float *restrict delta,
+		float *restrict output,
+		int n_output);
+
 static float nn_act_func_derivate(ACT_FUNC_TYPE act_func_type, float output);
 
 static int
@@ -95,18 +157,211 @@ nn_forward_propagation(ACT_FUNC_TYPE act_func_type,
 			output[i] += weight[i * n_input + j] * input[j];
 		}
 		/* Do activation function */
-		switch (act_func_type)
+		output[i] = nn_act_func(act_func_type, output[i]);
+	}
+}
+
+static void
+nn_forward_propagation_batch(ACT_FUNC_TYPE act_func_type,
+		int use_bias,
+		float *input,
+		int n_input,
+		float *output,
+		int n_output,
+		float *bias,
+		float *weight,
+		int packed,
+		int n_batch)
+{
+	int i;
+	int j;
+	int b;
+	float sum;
+	float *w;
+	float *in;
+
+	/* input is n_batch x n_input, output is n_batch x n_output, both row-major */
+	if (packed && n_output >= NN_PANEL_MIN)
+	{
+		/* A layer's panels are small enough to stay hot for the whole batch */
+		for (b = 0; b < n_batch; b++)
+			nn_forward_propagation_packed(act_func_type,
+					use_bias,
+					&input[b * n_input],
+					n_input,
+					&output[b * n_output],
+					n_output,
+					bias,
+					weight);
+		return;
+	}
+
+	/* Keep one weight row hot while it is applied to every sample of the batch */
+	for (i = 0; i < n_output; i++)
+	{
+		w = &weight[i * n_input];
+		for (b = 0; b < n_batch; b++)
+		{
+			in = &input[b * n_input];
+			if (use_bias)
+				sum = bias[i];
+			else
+				sum = 0;
+			/* Same summation order as nn_forward_propagation */
+			for (j = 0; j < n_input; j++)
+			{
+				sum += w[j] * in[j];
+			}
+			output[b * n_output + i] = nn_act_func(act_func_type, sum);
+		}
+	}
+}
+
+/*
+ * Forward propagation with the packed weight of a layer.
+ * A panel's sums stay in a local buffer while every input is added to all of them,
+ * each sum still goes along the input in the order of nn_forward_propagation.
+ */
+static void
+nn_forward_propagation_packed(ACT_FUNC_TYPE act_func_type,
+		int use_bias,
+		float *input,
+		int n_input,
+		float *output,
+		int n_output,
+		float *bias,
+		float *packed)
+{
+	int i;
+	int j;
+	int p;
+	int n;
+	int width;
+	float x;
+	float sum[NN_PANEL];
+	float *w;
+
+	width = nn_panel_width(n_output);
+	for (i = 0; i < n_output; i += width)
+	{
+		n = n_output - i < width ? n_output - i : width;
+		for (p = 0; p < width; p++)
+			sum[p] = use_bias && p < n ? bias[i + p] : 0;
+
+		for (j = 0; j < n_input; j++)
+		{
+			x = input[j];
+			w = &packed[i * n_input + j * width];
+			for (p = 0; p < width; p++)
+				sum[p] += w[p] * x;
+		}
+
+		for (p = 0; p < n; p++)
+			output[i + p] = nn_act_func(act_func_type, sum[p]);
+	}
+}
+
+/* Output neurons of a panel of a layer */
+static int
+nn_panel_width(int n_output)
+{
+	if (n_output >= NN_PANEL)
+		return NN_PANEL;
+	return (n_output + NN_VECTOR - 1) / NN_VECTOR * NN_VECTOR;
+}
+
+/* Rows of a layer's packed weight, n_output padded to whole panels unless the layer stays rows */
+static int
+nn_n_panel_row(int n_output)
+{
+	int width;
+
+	if (n_output < NN_PANEL_MIN)
+		return n_output;
+	width = nn_panel_width(n_output);
+	return (n_output + width - 1) / width * width;
+}
+
+/* Pack weight again, a loop of nn_train calls this once it is done so runs get the panels back */
+void
+nn_pack(NeuralNetwork *nn)
+{
+	int i;
+	int j;
+	int k;
+	int n_input;
+	int n_output;
+	int n_row;
+	int width;
+	size_t size;
+	float *weight;
+	float *packed;
+
+	if (nn->_packed_weight == NULL)
+	{
+		size = 0;
+		n_input = nn->n_input;
+		for (k = 0; k <= nn->n_hidden; k++)
 		{
-			case ACT_FUNC_TYPE_SIGMOID:
-				output[i] = 1.0f / (1.0f + exp(-output[i]));
-				break;
-			case ACT_FUNC_TYPE_TANH:
-				output[i] = tanh(output[i]);
-				break;
-			default:
-				break;
+			n_output = k < nn->n_hidden ? nn->n_neuro_per_hidden : nn->n_output;
+			size += nn_n_panel_row(n_output) * n_input * sizeof(float);
+			n_input = n_output;
 		}
+
+		/* The first panel starts on 32 bytes, aligned_alloc wants a size of whole alignments */
+		size = (size + 31) / 32 * 32;
+		nn->_packed_weight = aligned_alloc(32, size ? size : 32);
 	}
+
+	weight = nn->weight;
+	packed = nn->_packed_weight;
+	n_input = nn->n_input;
+	for (k = 0; k <= nn->n_hidden; k++)
+	{
+		n_output = k < nn->n_hidden ? nn->n_neuro_per_hidden : nn->n_output;
+		n_row = nn_n_panel_row(n_output);
+		width = nn_panel_width(n_output);
+
+		if (n_output < NN_PANEL_MIN)
+		{
+			memcpy(packed, weight, n_output * n_input * sizeof(float));
+		}
+		else
+		{
+			/* Row i, input j goes to the panel starting at row i - i % width, slot j * width + i % width */
+			for (i = 0; i < n_row; i++)
+			{
+				for (j = 0; j < n_input; j++)
+				{
+					packed[(i - i % width) * n_input + j * width + i % width] =
+						i < n_output ? weight[i * n_input + j] : 0;
+				}
+			}
+		}
+
+		weight += n_output * n_input;
+		packed += n_row * n_input;
+		n_input = n_output;
+	}
+
+	nn->_packed_dirty = 0;
+}
+
+static float
+nn_act_func(ACT_FUNC_TYPE act_func_type, float x)
+{
+	switch (act_func_type)
+	{
+		case ACT_FUNC_TYPE_SIGMOID:
+			return 1.0f / (1.0f + exp(-x));
+
+		case ACT_FUNC_TYPE_TANH:
+			return tanh(x);
+
+		default:
+			break;
+	}
+	return x;
 }
 
 static void
@@ -123,6 +378,72 @@ nn_correct(float *weight, float *delta, float *input, int n_input, int n_output,
 	}
 }
 
+/*
+ * Back propagate next_delta through the next layer's weight into delta, and correct that weight in the same pass.
+ * Row k of the weight is read once and contiguously: its old values go to delta, then the row is corrected.
+ * delta is summed over k in the same order as the column by column product, so the results are the same.
+ */
+static void
+nn_back_propagation(float *restrict weight,
+		float *restrict next_delta,
+		int n_next_output,
+		float *restrict delta,
+		float *restrict output,
+		int n_output,
+		float rate)
+{
+	int j;
+	int k;
+	float d;
+	float *restrict w;
+
+	for (j = 0; j < n_output; j++)
+		delta[j] = 0;
+
+	for (k = 0; k < n_next_output; k++)
+	{
+		w = &weight[k * n_output];
+		d = next_delta[k];
+		for (j = 0; j < n_output; j++)
+		{
+			delta[j] += d * w[j];
+			w[j] += d * output[j] * rate;
+		}
+	}
+}
+
+/* Like nn_back_propagation, but the correction is added to grad and the weight stays as it is */
+static void
+nn_back_propagation_gradient(float *restrict weight,
+		float *restrict grad,
+		float *restrict next_delta,
+		int n_next_output,
+		float *restrict delta,
+		float *restrict output,
+		int n_output)
+{
+	int j;
+	int k;
+	float d;
+	float *restrict w;
+	float *restrict g;
+
+	for (j = 0; j < n_output; j++)
+		delta[j] = 0;
+
+	for (k = 0; k < n_next_output; k++)
+	{
+		w = &weight[k * n_output];
+		g = &grad[k * n_output];
+		d = next_delta[k];
+		for (j = 0; j < n_output; j++)
+		{
+			delta[j] += d * w[j];
+			g[j] += d * output[j];
+		}
+	}
+}
+
 static float
 nn_act_func_derivate(ACT_FUNC_TYPE act_func_type, float output)
 {
@@ -140,8 +461,9 @@ nn_act_func_derivate(ACT_FUNC_TYPE act_func_type, float output)
 	return 1.0f;
 }
 
-NeuralNetwork *
-nn_create(int n_input,
+/* A network with its buffers, the weights are left as they are */
+static NeuralNetwork *
+nn_alloc(int n_input,
 		int n_output,
 		int n_hidden,
 		int n_neuro_per_hidden,
@@ -149,7 +471,6 @@ nn_create(int n_input,
 		ACT_FUNC_TYPE act_func_type_hidden,
 		ACT_FUNC_TYPE act_func_type_output)
 {
-	int i;
 	NeuralNetwork *nn;
 
 	/* Error check */
@@ -179,6 +500,36 @@ nn_create(int n_input,
 		nn->bias = malloc(nn->_n_neuro * sizeof(float));
 	nn->output = malloc(nn->_n_neuro * sizeof(float));
 	nn->delta = malloc(nn->_n_neuro * sizeof(float));
+	nn->_batch_output = NULL;
+	nn->_batch_cap = 0;
+	nn->_packed_weight = NULL;
+	nn->_packed_dirty = 1;
+	nn->_fold_scratch = NULL;
+	nn->_fold_scratch_len = 0;
+
+	return nn;
+}
+
+NeuralNetwork *
+nn_create(int n_input,
+		int n_output,
+		int n_hidden,
+		int n_neuro_per_hidden,
+		int use_bias,
+		ACT_FUNC_TYPE act_func_type_hidden,
+		ACT_FUNC_TYPE act_func_type_output)
+{
+	NeuralNetwork *nn;
+
+	nn = nn_alloc(n_input,
+			n_output,
+			n_hidden,
+			n_neuro_per_hidden,
+			use_bias,
+			act_func_type_hidden,
+			act_func_type_output);
+	if (nn == NULL)
+		return NULL;
 
 	nn_randomize(nn);
 
@@ -224,6 +575,7 @@ nn_produce(NeuralNetwork *a, NeuralNetwork *b)
 	{
 		nn->weight[i] = rand() & 1 ? a->weight[i] : b->weight[i];
 	}
+	nn_pack(nn);
 
 	return nn;
 }
@@ -236,6 +588,9 @@ nn_free(NeuralNetwork *nn)
 		free(nn->bias);
 	free(nn->output);
 	free(nn->delta);
+	free(nn->_batch_output);
+	free(nn->_packed_weight);
+	free(nn->_fold_scratch);
 	free(nn);
 }
 
@@ -258,27 +613,143 @@ nn_duplicate(NeuralNetwork *nn)
 	memcpy(new_nn->weight, nn->weight, nn->_n_weight * sizeof(float));
 	if (nn->use_bias)
 		memcpy(new_nn->bias, nn->bias, nn->_n_neuro * sizeof(float));
+	nn_pack(new_nn);
 
 	return new_nn;
 }
 
-float *
-nn_run(NeuralNetwork *nn, float *input)
+/*
+ * Linear hidden layers compose into one matrix, so fold nn into a network without hidden layers
+ * which gives the same outputs up to rounding, for running only.
+ * folded is reused when it has the shape of the result, otherwise it is freed and a new one returned.
+ * Returns NULL when nn has no linear hidden layer to fold.
+ */
+NeuralNetwork *
+nn_fold(NeuralNetwork *nn, NeuralNetwork *folded)
 {
 	int i;
 	int j;
 	int k;
-	float *output;  /* Output buffer of this layer */
+	int l;
+	int n_prev;		 /* Outputs of the layers folded so far */
+	int n_output;
+	float *bias;
+	float *weight;
+	double *a;		  /* Layers folded so far, n_prev x n_input */
+	double *c;		  /* Their bias */
+	double *next_a;
+	double *next_c;
+	double *tmp;
+	int n_max;
+
+	if (nn->n_hidden == 0 || nn->act_func_type_hidden != ACT_FUNC_TYPE_LINEAR)
+		return NULL;
+
+	if (folded && (folded->n_input != nn->n_input ||
+				folded->n_output != nn->n_output ||
+				folded->n_hidden != 0 ||
+				folded->use_bias != nn->use_bias ||
+				folded->act_func_type_output != nn->act_func_type_output))
+	{
+		nn_free(folded);
+		folded = NULL;
+	}
+	if (folded == NULL)
+	{
+		folded = nn_alloc(nn->n_input,
+				nn->n_output,
+				0,
+				0,
+				nn->use_bias,
+				nn->act_func_type_hidden,
+				nn->act_func_type_output);
+	}
+
+	/* Two folded layers and their bias, in the scratch of folded */
+	n_max = nn->n_neuro_per_hidden > nn->n_output ? nn->n_neuro_per_hidden : nn->n_output;
+	if (folded->_fold_scratch_len < 2 * n_max * (nn->n_input + 1))
+	{
+		free(folded->_fold_scratch);
+		folded->_fold_scratch_len = 2 * n_max * (nn->n_input + 1);
+		folded->_fold_scratch = malloc(folded->_fold_scratch_len * sizeof(double));
+	}
+	a = folded->_fold_scratch;
+	next_a = a + n_max * nn->n_input;
+	c = next_a + n_max * nn->n_input;
+	next_c = c + n_max;
+
+	/* Start with the first hidden layer, in double so the product adds little rounding */
+	n_prev = nn->n_neuro_per_hidden;
+	for (i = 0; i < n_prev * nn->n_input; i++)
+		a[i] = nn->weight[i];
+	for (i = 0; i < n_prev; i++)
+		c[i] = nn->use_bias ? nn->bias[i] : 0;
+
+	weight = nn->weight + n_prev * nn->n_input;
+	bias = nn->use_bias ? nn->bias + n_prev : NULL;
+	for (k = 1; k <= nn->n_hidden; k++)
+	{
+		/* The output layer comes after the last hidden layer */
+		n_output = k < nn->n_hidden ? nn->n_neuro_per_hidden : nn->n_output;
+
+		/* next = layer weight * folded so far, next bias = layer weight * folded bias + layer bias */
+		for (i = 0; i < n_output; i++)
+		{
+			for (j = 0; j < nn->n_input; j++)
+				next_a[i * nn->n_input + j] = 0;
+			next_c[i] = bias ? bias[i] : 0;
+			for (j = 0; j < n_prev; j++)
+			{
+				for (l = 0; l < nn->n_input; l++)
+					next_a[i * nn->n_input + l] += weight[i * n_prev + j] * a[j * nn->n_input + l];
+				next_c[i] += weight[i * n_prev + j] * c[j];
+			}
+		}
+
+		tmp = a;
+		a = next_a;
+		next_a = tmp;
+		tmp = c;
+		c = next_c;
+		next_c = tmp;
+
+		weight += n_output * n_prev;
+		if (bias)
+			bias += n_output;
+		n_prev = n_output;
+	}
+
+	for (i = 0; i < folded->_n_weight; i++)
+		folded->weight[i] = (float)a[i];
+	if (folded->use_bias)
+	{
+		for (i = 0; i < folded->n_output; i++)
+			folded->bias[i] = (float)c[i];
+	}
+	nn_pack(folded);
+
+	return folded;
+}
+
+/*
+ * Run nn with the packed weight, or with weight itself for a caller which changes it every run,
+ * repacking would cost more than the packed run saves.
+ * Weight trained since the last pack is run as it is, a run never writes the packed weight.
+ */
+static float *
+nn_forward(NeuralNetwork *nn, float *input, int packed, float *output)
+{
+	int i;
 	float *bias;	/* Bias of this layer */
 	float *weight;  /* Weight matrix of this layer */
 	int n_input;	/* Number of input or Number of output of previous layer */
 	int n_output;   /* Number of output of this layer */
 
 	n_input = nn->n_input;
-	output = nn->output;
-	if (nn->use_bias)
-		bias = nn->bias;
-	weight = nn->weight;
+	bias = nn->use_bias ? nn->bias : NULL;
+	if (nn->_packed_dirty)
+		packed = 0;
+	weight = packed ? nn->_packed_weight : nn->weight;
 	/*
 	 * 1. Process the hidden layers if any
 	 */
@@ -287,7 +758,52 @@ nn_run(NeuralNetwork *nn, float *input)
 		/* So many outputs this layer */
 		n_output = nn->n_neuro_per_hidden;
 		/* Forward propergation */
-		nn_forward_propagation(nn->act_func_type_hidden,
+		if (packed && n_output >= NN_PANEL_MIN)
+			nn_forward_propagation_packed(nn->act_func_type_hidden,
+					nn->use_bias,
+					input,
+					n_input,
+					output,
+					n_output,
+					bias,
+					weight);
+		else
+			nn_forward_propagation(nn->act_func_type_hidden,
+					nn->use_bias,
+					input,
+					n_input,
+					output,
+					n_output,
+					bias,
+					weight);
+
+		/* Move pointer forward to the next layer */
+		input = output; /* Output of this layer is the next layer's input */
+		output += n_output;			 /* Forwrad to the next layer */
+		if (nn->use_bias)
+			bias += n_output;
+		weight += n_input * (packed ? nn_n_panel_row(n_output) : n_output);   /* Forward to the next layer */
+		/* Set the number of input to the previous layer */
+		n_input = nn->n_neuro_per_hidden;
+	}
+
+	/*
+	 * 2. Process the output layer.
+	 */
+	/* So many outputs this layer */
+	n_output = nn->n_output;
+	/* Forward propergation */
+	if (packed && n_output >= NN_PANEL_MIN)
+		nn_forward_propagation_packed(nn->act_func_type_output,
+				nn->use_bias,
+				input,
+				n_input,
+				output,
+				n_output,
+				bias,
+				weight);
+	else
+		nn_forward_propagation(nn->act_func_type_output,
 				nn->use_bias,
 				input,
 				n_input,
@@ -296,62 +812,126 @@ nn_run(NeuralNetwork *nn, float *input)
 				bias,
 				weight);
 
-		/* Move pointer forward to the next layer */
-		input = output; /* Output of this layer is the next layer's input */
-		output += n_output;			 /* Forwrad to the next layer */
+	return output;
+}
+
+float *
+nn_run(NeuralNetwork *nn, float *input)
+{
+	return nn_forward(nn, input, 1, nn->output);
+}
+
+float *
+nn_run_batch(NeuralNetwork *nn, float *input, int n_batch)
+{
+	int i;
+	float *output;  /* Output matrix of this layer, n_batch x n_output */
+	float *bias;	/* Bias of this layer */
+	float *weight;  /* Weight matrix of this layer */
+	int n_input;	/* Number of input or Number of output of previous layer */
+	int n_output;   /* Number of output of this layer */
+	int packed;
+
+	if (n_batch < 1)
+		return NULL;
+
+	/* Make room for every layer's output of the whole batch */
+	if (nn->_batch_cap < n_batch)
+	{
+		free(nn->_batch_output);
+		nn->_batch_output = malloc(n_batch * nn->_n_neuro * sizeof(float));
+		nn->_batch_cap = n_batch;
+	}
+
+	n_input = nn->n_input;
+	output = nn->_batch_output;
+	bias = nn->use_bias ? nn->bias : NULL;
+	packed = !nn->_packed_dirty;
+	weight = packed ? nn->_packed_weight : nn->weight;
+	/*
+	 * 1. Process the hidden layers if any
+	 */
+	for (i = 0; i < nn->n_hidden; i++)
+	{
+		n_output = nn->n_neuro_per_hidden;
+		nn_forward_propagation_batch(nn->act_func_type_hidden,
+				nn->use_bias,
+				input,
+				n_input,
+				output,
+				n_output,
+				bias,
+				weight,
+				packed,
+				n_batch);
+
+		/* Output of this layer is the next layer's input */
+		input = output;
+		output += n_batch * n_output;
 		if (nn->use_bias)
 			bias += n_output;
-		weight += n_input * n_output;   /* Forward to the next layer */
-		/* Set the number of input to the previous layer */
+		weight += n_input * (packed ? nn_n_panel_row(n_output) : n_output);
 		n_input = nn->n_neuro_per_hidden;
 	}
 
 	/*
 	 * 2. Process the output layer.
 	 */
-	/* So many outputs this layer */
 	n_output = nn->n_output;
-	/* Forward propergation */
-	nn_forward_propagation(nn->act_func_type_output,
+	nn_forward_propagation_batch(nn->act_func_type_output,
 			nn->use_bias,
 			input,
 			n_input,
 			output,
 			n_output,
 			bias,
-			weight);
+			weight,
+			packed,
+			n_batch);
 
 	return output;
 }
 
-float *
-nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
+/*
+ * One step of back propagation with the given output and delta buffers.
+ * Without grad_weight the weight and bias are corrected in place,
+ * otherwise the corrections for a rate of 1 are added to grad_weight and grad_bias.
+ */
+static float *
+nn_backward(NeuralNetwork *nn,
+		float *input,
+		float *expect,
+		float rate,
+		float *output,
+		float *delta,
+		float *grad_weight,
+		float *grad_bias)
 {
 	int i;
 	int j;
-	int k;
 	float *ret;
 	int n_output;	   /* Number of output of this layer */
 	int n_next_output;   /* Number of the neuro of next layer */
-	float *delta;	   /* Delta of this layer */
-	float *output;	  /* Output of this layer */
-	float *bias;		/* Bias of this layer */
+	float *bias;		/* Bias of this layer, or its gradient */
+	float *next_grad;   /* Gradient of the next layer's weight */
 	float *next_delta;  /* delta of next layer */
 	float *next_weight; /* delta of next layer */
 
 	/*
 	 * 0. Run once
 	 */
-	ret = nn_run(nn, input);
+	ret = nn_forward(nn, input, 0, output);
+	next_grad = grad_weight ? &grad_weight[nn->_n_weight] : NULL;
+	if (grad_weight)
+		rate = 1;
 
 	/*
 	 * 1. From the output layer, do back propagation computation.
 	 */
 	n_output = nn->n_output;
-	output = &nn->output[nn->_n_neuro - nn->n_output];
-	if (nn->use_bias)
-		bias = &nn->bias[nn->_n_neuro - nn->n_output];
-	delta = &nn->delta[nn->_n_neuro - nn->n_output];
+	output += nn->_n_neuro - nn->n_output;
+	bias = nn->use_bias ? &(grad_weight ? grad_bias : nn->bias)[nn->_n_neuro - nn->n_output] : NULL;
+	delta += nn->_n_neuro - nn->n_output;
 
 	/*
 	 * Compute delta of this layer, also fix bias of this layer
@@ -377,6 +957,8 @@ nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
 		n_output = nn->n_neuro_per_hidden;
 		/* Move weight to this layer */
 		next_weight -= n_next_output * n_output;
+		if (grad_weight)
+			next_grad -= n_next_output * n_output;
 
 		/* Move next_delta, delta, output to this layer */
 		next_delta = delta;
@@ -386,38 +968,33 @@ nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
 		output -= n_output;
 
 		/*
-		 * a. Compute delta of this layer, also fix bias of this layer
+		 * a. The j-th neuro's delta is
+		 * "the next layer's delta" dot "the j-th column vector of the next layer's weight matrix",
+		 * computed together with the correction of the next layer's weight
+		 */
+		if (grad_weight)
+			nn_back_propagation_gradient(next_weight, next_grad, next_delta, n_next_output, delta, output, n_output);
+		else
+			nn_back_propagation(next_weight, next_delta, n_next_output, delta, output, n_output, rate);
+
+		/*
+		 * b. Apply derivation of this layer's neurons, also fix bias of this layer
 		 */
 		for (j = 0; j < n_output; j++)
 		{
-			/*
-			 * The j-th neuro's delta is
-			 * "the next layer's delta" dot t"he j-th column vector of the next layer's weight matrix"
-			 * times the derivation of this neuro
-			 */
-			delta[j] = 0;
-			for (k = 0; k < n_next_output; k++)
-			{
-				delta[j] += next_delta[k] * next_weight[k * n_output + j];
-			}
-
-			/* Apply derivation of this neuro */
 			delta[j] *= nn_act_func_derivate(nn->act_func_type_hidden, output[j]);
 
 			if (nn->use_bias)
 				bias[j] += delta[j] * rate;
 		}
-
-		/*
-		 * b. Correct the next layer's weight
-		 */
-		nn_correct(next_weight, next_delta, output, n_output, n_next_output, rate);
 	}
 
 	n_next_output = n_output;
 	n_output = nn->n_input;
 	/* Move weight to this layer */
 	next_weight -= n_next_output * n_output;
+	if (grad_weight)
+		next_grad -= n_next_output * n_output;
 
 	/* Move next_delta, output to this layer */
 	next_delta = delta;
@@ -426,10 +1003,63 @@ nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
 	/*
 	 * Correct the next layer's weight
 	 */
-	nn_correct(next_weight, next_delta, output, n_output, n_next_output, rate);
+	nn_correct(grad_weight ? next_grad : next_weight, next_delta, output, n_output, n_next_output, rate);
+	/* Only written when it changes, threads training one network at once then do not race on it */
+	if (grad_weight == NULL && !nn->_packed_dirty)
+		nn->_packed_dirty = 1;
 	return ret;
 }
 
+float *
+nn_train(NeuralNetwork *nn, float *input, float *expect, float rate)
+{
+	return nn_backward(nn, input, expect, rate, nn->output, nn->delta, NULL, NULL);
+}
+
+/*
+ * nn_train with the output and delta buffers of buf instead of the network's own,
+ * so threads can train one network at once, each with its own buf
+ */
+float *
+nn_train_buffered(NeuralNetwork *nn, NNTrainBuffer *buf, float *input, float *expect, float rate)
+{
+	return nn_backward(nn, input, expect, rate, buf->output, buf->delta, NULL, NULL);
+}
+
+/* Add the correction nn_train would make with a rate of 1 to the gradient of buf, nn stays as it is */
+float *
+nn_gradient_add(NeuralNetwork *nn, NNTrainBuffer *buf, float *input, float *expect)
+{
+	if (buf->grad_weight == NULL)
+		return NULL;
+
+	return nn_backward(nn, input, expect, 1, buf->output, buf->delta, buf->grad_weight, buf->grad_bias);
+}
+
+/* Buffers to train nn from one thread, with a zeroed gradient if with_gradient is set */
+void
+nn_train_buffer_init(NNTrainBuffer *buf, NeuralNetwork *nn, int with_gradient)
+{
+	buf->output = malloc(nn->_n_neuro * sizeof(float));
+	buf->delta = malloc(nn->_n_neuro * sizeof(float));
+	buf->grad_weight = NULL;
+	buf->grad_bias = NULL;
+	if (with_gradient)
+	{
+		buf->grad_weight = calloc(nn->_n_weight, sizeof(float));
+		buf->grad_bias = calloc(nn->_n_neuro, sizeof(float));
+	}
+}
+
+void
+nn_train_buffer_release(NNTrainBuffer *buf)
+{
+	free(buf->output);
+	free(buf->delta);
+	free(buf->grad_weight);
+	free(buf->grad_bias);
+}
+
 void
 nn_plus_randomize(NeuralNetwork *nn, float range)
 {
@@ -447,6 +1077,7 @@ nn_plus_randomize(NeuralNetwork *nn, float range)
 	{
 		nn->weight[i] += nn_gen_random() * 2 * range;
 	}
+	nn_pack(nn);
 }
 
 void
@@ -469,6 +1100,7 @@ nn_plus_randomize_by_rate(NeuralNetwork *nn, float range, float rate)
 			nn->weight[i] += nn_gen_random() * 2 * range;
 	}
 
+	nn_pack(nn);
 }
 
 void
@@ -488,6 +1120,7 @@ nn_randomize(NeuralNetwork *nn)
 	{
 		nn->weight[i] = nn_gen_random() * 2;
 	}
+	nn_pack(nn);
 }
 
 void
@@ -507,6 +1140,7 @@ nn_randomize_with_scale(NeuralNetwork *nn, float scale)
 	{
 		nn->weight[i] = nn_gen_random() * 2 * scale ;
 	}
+	nn_pack(nn);
 }
 
 void
@@ -528,6 +1162,7 @@ nn_randomize_by_rate(NeuralNetwork *nn, float rate)
 		if (random_pick(rate))
 			nn->weight[i] = nn_gen_random() * 2;
 	}
+	nn_pack(nn);
 }
 
 void
@@ -550,6 +1185,7 @@ nn_randomize_with_scale_by_rate(NeuralNetwork *nn, float scale, float rate)
 			nn->weight[i] = nn_gen_random() * 2 * scale;
 	}
 
+	nn_pack(nn);
 }
 
 int
@@ -604,11 +1240,11 @@ nn_savef(NeuralNetwork *nn, FILE *f)
 		return -1;
 
 	/* write weight and bias */
-	if (fwrite(nn->weight, sizeof(float), nn->_n_weight, f) != nn->_n_weight)
+	if (fwrite(nn->weight, sizeof(float), nn->_n_weight, f) != (size_t)nn->_n_weight)
 		return -1;
 	if (nn->use_bias)
 	{
-		if (fwrite(nn->bias, sizeof(float), nn->_n_neuro, f) != nn->_n_neuro)
+		if (fwrite(nn->bias, sizeof(float), nn->_n_neuro, f) != (size_t)nn->_n_neuro)
 			return -1;
 	}
 
@@ -646,15 +1282,22 @@ nn_loadf(FILE *f)
 		nn->bias = malloc(nn->_n_neuro * sizeof(float));
 	nn->output = malloc(nn->_n_neuro * sizeof(float));
 	nn->delta = malloc(nn->_n_neuro * sizeof(float));
+	nn->_batch_output = NULL;
+	nn->_batch_cap = 0;
+	nn->_packed_weight = NULL;
+	nn->_packed_dirty = 1;
+	nn->_fold_scratch = NULL;
+	nn->_fold_scratch_len = 0;
 
 	/* read weight and bias */
-	if (fread(nn->weight, sizeof(float), nn->_n_weight, f) != nn->_n_weight)
+	if (fread(nn->weight, sizeof(float), nn->_n_weight, f) != (size_t)nn->_n_weight)
 		goto __error_2;
 	if (nn->use_bias)
 	{
-		if (fread(nn->bias, sizeof(float), nn->_n_neuro, f) != nn->_n_neuro)
+		if (fread(nn->bias, sizeof(float), nn->_n_neuro, f) != (size_t)nn->_n_neuro)
 			goto __error_2;
 	}
+	nn_pack(nn);
 
 	return nn;
 
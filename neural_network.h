@@ -3,6 +3,15 @@
 
 #include <stdio.h>
 
+/*
+ * Output neurons a panel of the packed weight holds at most, a narrower layer is one panel
+ * padded to NN_VECTOR, the floats of an AVX register.
+ * Layers of fewer than NN_PANEL_MIN outputs run faster on plain rows, they stay rows when packed.
+ */
+#define NN_PANEL		64
+#define NN_VECTOR		8
+#define NN_PANEL_MIN	16
+
 typedef enum {
 	ACT_FUNC_TYPE_LINEAR,
 	ACT_FUNC_TYPE_SIGMOID,
@@ -26,8 +35,34 @@ typedef struct {
 	float *bias;
 	float *output;
 	float *delta;
+
+	/* Output buffer of every layer for nn_run_batch, grown on demand */
+	float *_batch_output;
+	int _batch_cap;
+
+	/*
+	 * weight packed for nn_run and nn_run_batch, every wide layer in panels of output neurons,
+	 * a panel holds the weights of each input to its neurons side by side, rows past n_output are 0.
+	 * Repacked whenever weight is set, except by nn_train and nn_train_buffered which only set _packed_dirty
+	 * as packing after every sample would cost more than the sample, runs then use weight until nn_pack.
+	 * weight stays the one saved and evolved.
+	 */
+	float *_packed_weight;
+	int _packed_dirty;
+
+	/* Scratch of nn_fold when this is the folded network, kept so folding again does not allocate */
+	double *_fold_scratch;
+	int _fold_scratch_len;
 } NeuralNetwork;
 
+/* Output and delta buffers of one training thread, and the gradient it sums over a batch */
+typedef struct {
+	float *output;
+	float *delta;
+	float *grad_weight;	/* NULL when it trains in place */
+	float *grad_bias;
+} NNTrainBuffer;
+
 NeuralNetwork *nn_create(int n_input,
 		int n_output,
 		int n_hidden,
@@ -42,10 +77,24 @@ void nn_free(NeuralNetwork *nn);
 
 NeuralNetwork *nn_duplicate(NeuralNetwork *nn);
 
+NeuralNetwork *nn_fold(NeuralNetwork *nn, NeuralNetwork *folded);
+
 float *nn_run(NeuralNetwork *nn, float *input);
 
+float *nn_run_batch(NeuralNetwork *nn, float *input, int n_batch);
+
 float *nn_train(NeuralNetwork *nn, float *input, float *expect, float rate);
 
+void nn_pack(NeuralNetwork *nn);
+
+float *nn_train_buffered(NeuralNetwork *nn, NNTrainBuffer *buf, float *input, float *expect, float rate);
+
+float *nn_gradient_add(NeuralNetwork *nn, NNTrainBuffer *buf, float *input, float *expect);
+
+void nn_train_buffer_init(NNTrainBuffer *buf, NeuralNetwork *nn, int with_gradient);
+
+void nn_train_buffer_release(NNTrainBuffer *buf);
+
 void nn_plus_randomize(NeuralNetwork *nn, float range);
 
 void nn_plus_randomize_by_rate(NeuralNetwork *nn, float range, float rate);
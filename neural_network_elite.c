@@ -1,171 +1,176 @@
 #include "neural_network_elite.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-typedef struct _NNEliteList{
+typedef struct _NNElite{
 	NeuralNetwork *nn;
 	float goodness;
-	void *prev;
-	void *next;
-} _NNEliteList;
+} _NNElite;
 
-static void _nn_elite_free(_NNEliteList *el);
+static void _nn_elites_reserve(NNEliteList *list, int cap);
 
-static void _nn_elist_list_link(_NNEliteList *el1, _NNEliteList *el2);
+static int _nn_elites_find_insert(NNEliteList *list, float goodness);
 
 static void
-_nn_elite_free(_NNEliteList *el)
+_nn_elites_reserve(NNEliteList *list, int cap)
 {
-	nn_free(el->nn);
-	free(el);
+	if (cap <= list->cap)
+		return;
+
+	/* Grow by doubling, never past what the list may hold */
+	if (cap < list->cap * 2)
+		cap = list->cap * 2;
+	if (cap > list->max_len)
+		cap = list->max_len;
+
+	list->elites = realloc(list->elites, sizeof(_NNElite) * cap);
+	list->cap = cap;
 }
 
-static void
-_nn_elist_list_link(_NNEliteList *el1, _NNEliteList *el2)
+static int
+_nn_elites_find_insert(NNEliteList *list, float goodness)
 {
-	el1->next = el2;
-	el2->prev = el1;
+	_NNElite *elites;
+	int lo;
+	int hi;
+	int mid;
+
+	/* First elite worse than goodness, so a new elite goes behind the equally good ones */
+	elites = list->elites;
+	lo = 0;
+	hi = list->count;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (elites[mid].goodness < goodness)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
 }
 
 void
 nn_elites_init_list(NNEliteList *list, int max_len)
 {
-	list->list_head = NULL;
 	list->max_len = max_len;
+	list->count = 0;
+	list->cap = 0;
+	list->elites = NULL;
 }
 
 void
 nn_elites_add(NNEliteList *list, NeuralNetwork *nn, float goodness)
 {
-	_NNEliteList *new_node;
-	_NNEliteList *ptr;
+	_NNElite *elites;
+	int pos;
 
-	new_node = malloc(sizeof(*new_node));
-	new_node->goodness = goodness;
-	new_node->nn = nn;
-	new_node->next = NULL;
-	new_node->prev = NULL;
-
-	if (list->list_head == NULL)
+	pos = _nn_elites_find_insert(list, goodness);
+	if (pos >= list->max_len)
 	{
-		/* First add */
-		new_node->next = new_node;
-		new_node->prev = new_node;
-		list->list_head = new_node;
+		/* Worse than every elite of a full list */
+		nn_free(nn);
 		return;
 	}
 
-	/* Find where to insert the node so the best could be in the front of the list */
-	ptr = list->list_head;
-	do
-	{
-		if (ptr->goodness < goodness)
-			break;
-		ptr = ptr->next;
-	}
-	while (ptr != list->list_head);
-
-	/* new_node is better than ptr node */
-	_nn_elist_list_link(ptr->prev, new_node);
-	_nn_elist_list_link(new_node, ptr);
-
-	/* Only 2 possible situation ptr is list_head,
-	 * 1. new node is better. so it breaks and put behind the list_head.
-	 * 2. new node is the worst. so it's put to the last position(behind the list_head)
-	 */
-	if (ptr == list->list_head &&
-		ptr->goodness < goodness)
-		list->list_head = new_node;
-
-	if (list->max_len < nn_elites_get_count(list))
+	if (list->count == list->max_len)
 	{
-		_NNEliteList *worst;
-
-		worst = ((_NNEliteList*)list->list_head)->prev;
-
 		/* The worst gets freed */
-		((_NNEliteList *)worst->prev)->next = worst->next;
-		((_NNEliteList *)worst->next)->prev = worst->prev;
-		_nn_elite_free(worst);
+		list->count--;
+		nn_free(((_NNElite *)list->elites)[list->count].nn);
 	}
+
+	_nn_elites_reserve(list, list->count + 1);
+	elites = list->elites;
+	memmove(&elites[pos + 1], &elites[pos], sizeof(_NNElite) * (list->count - pos));
+	elites[pos].nn = nn;
+	elites[pos].goodness = goodness;
+	list->count++;
 }
 
 void
 nn_elites_clear(NNEliteList *list)
 {
-	_NNEliteList *el;
-
-	if (nn_elites_get_count(list) == 0)
-		return;
-
-	el = list->list_head;
-	while (el->next != list->list_head)
-	{
-		el = el->next;
-		_nn_elite_free(el->prev);
-	};
+	_NNElite *elites;
+	int i;
 
-	_nn_elite_free(el);
+	elites = list->elites;
+	for (i = 0; i < list->count; i++)
+		nn_free(elites[i].nn);
 
-	list->list_head = NULL;
+	free(list->elites);
+	list->elites = NULL;
+	list->count = 0;
+	list->cap = 0;
 }
 
 NeuralNetwork *
 nn_elites_pick_by_random(NNEliteList *list, NeuralNetwork *dont_pick)
 {
-	int i;
-	_NNEliteList *el;
-	int e_cnt;
+	_NNElite *elites;
+	NeuralNetwork *nn;
 
-	e_cnt = nn_elites_get_count(list);
-	if (e_cnt == 0)
+	if (list->count == 0)
 		return NULL;
 
-	el = list->list_head;
+	elites = list->elites;
 	do
 	{
-		i = rand() % e_cnt;
-		el = list->list_head;
-		while (i)
-		{
-			el = el->next;
-			i--;
-		}
-		if (e_cnt == 1)
+		nn = elites[rand() % list->count].nn;
+		if (list->count == 1)
 			break;
 	}
-	while (el->nn == dont_pick);
+	while (nn == dont_pick);
 
-	return el->nn;
+	return nn;
 }
 
 NeuralNetwork *
 nn_elites_get_best(NNEliteList *list)
 {
-	if (list->list_head == NULL)
+	if (list->count == 0)
 		return NULL;
 
-	return ((_NNEliteList*)list->list_head)->nn;
+	return ((_NNElite *)list->elites)[0].nn;
 }
 
-int
-nn_elites_get_count(NNEliteList *list)
+NeuralNetwork *
+nn_elites_get_nth(NNEliteList *list, int n, float *goodness)
 {
-	int cnt;
-	_NNEliteList *el;
+	_NNElite *el;
 
-	el = list->list_head;
-	if (el == NULL)
-		return 0;
+	/* n counts from the best, 0 is the best */
+	if (n < 0 || n >= list->count)
+		return NULL;
 
-	cnt = 0;
-	do
-	{
-		cnt++;
-		el = el->next;
-	} while (el != list->list_head);
+	el = &((_NNElite *)list->elites)[n];
+	if (goodness)
+		*goodness = el->goodness;
+	return el->nn;
+}
+
+/* Take the worst elite out of the list, the caller owns it */
+NeuralNetwork *
+nn_elites_pop(NNEliteList *list, float *goodness)
+{
+	_NNElite *el;
+
+	if (list->count == 0)
+		return NULL;
+
+	list->count--;
+	el = &((_NNElite *)list->elites)[list->count];
+	if (goodness)
+		*goodness = el->goodness;
+	return el->nn;
+}
 
-	return cnt;
+int
+nn_elites_get_count(NNEliteList *list)
+{
+	return list->count;
 }
 
 int
@@ -201,27 +206,24 @@ nn_elites_load(NNEliteList *list, const char *file_name)
 int
 nn_elites_savef(NNEliteList *list, FILE *f)
 {
-	int cnt;
-	_NNEliteList *el;
+	_NNElite *elites;
+	int i;
 
 	if (fwrite(&list->max_len, sizeof(list->max_len), 1, f) != 1)
 		return -1;
 
-	cnt = nn_elites_get_count(list);
-	if (fwrite(&cnt, sizeof(cnt), 1, f) != 1)
+	if (fwrite(&list->count, sizeof(list->count), 1, f) != 1)
 		return -1;
 
-	el = list->list_head;
-	do
+	elites = list->elites;
+	for (i = 0; i < list->count; i++)
 	{
-		if (nn_savef(el->nn, f))
+		if (nn_savef(elites[i].nn, f))
 			return -1;
 
-		if (fwrite(&el->goodness, sizeof(el->goodness), 1, f) != 1)
+		if (fwrite(&elites[i].goodness, sizeof(elites[i].goodness), 1, f) != 1)
 			return -1;
-
-		el = el->next;
-	} while (el != list->list_head);
+	}
 
 	return 0;
 }
@@ -237,10 +239,11 @@ nn_elites_loadf(NNEliteList *list, FILE *f)
 	if (fread(&list->max_len, sizeof(list->max_len), 1, f) != 1)
 		return -1;
 
-	cnt = nn_elites_get_count(list);
 	if (fread(&cnt, sizeof(cnt), 1, f) != 1)
 		return -1;
 
+	/* Saved from the best, so every add lands at the end without moving anything */
+	_nn_elites_reserve(list, list->count + cnt);
 	for (i = 0; i < cnt; i++)
 	{
 		nn = nn_loadf(f);
@@ -259,19 +262,10 @@ nn_elites_loadf(NNEliteList *list, FILE *f)
 void
 nn_elite_show(NNEliteList *list)
 {
+	_NNElite *elites;
 	int i;
-	_NNEliteList *el;
-
-	el = list->list_head;
-	if (el == NULL)
-		return;
 
-	i = 0;
-	do
-	{
-		i++;
-		printf("Elite %d goodness: %6.2f\n", i, el->goodness);
-		el = el->next;
-	} while (el != list->list_head);
+	elites = list->elites;
+	for (i = 0; i < list->count; i++)
+		printf("Elite %d goodness: %6.2f\n", i + 1, elites[i].goodness);
 }
-
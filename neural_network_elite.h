@@ -3,9 +3,12 @@
 
 #include "neural_network.h"
 
+/* Elites sorted from the best, in one array so counting and indexing are free */
 typedef struct {
 	int max_len;
-	void *list_head;
+	int count;
+	int cap;
+	void *elites;
 } NNEliteList;
 
 void nn_elites_init_list(NNEliteList *list, int max_len);
@@ -18,6 +21,10 @@ NeuralNetwork *nn_elites_pick_by_random(NNEliteList *list, NeuralNetwork *dont_p
 
 NeuralNetwork *nn_elites_get_best(NNEliteList *list);
 
+NeuralNetwork *nn_elites_get_nth(NNEliteList *list, int n, float *goodness);
+
+NeuralNetwork *nn_elites_pop(NNEliteList *list, float *goodness);
+
 int nn_elites_get_count(NNEliteList *list);
 
 int nn_elites_save(NNEliteList *list, const char *file_name);
@@ -0,0 +1,199 @@
+#include "neural_network_parallel.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef struct NNParallel NNParallel;
+
+/* One training thread */
+typedef struct {
+	pthread_t thread;
+	int id;
+	NNTrainBuffer buf;
+	NNParallel *train;
+} NNParallelWorker;
+
+/* A pass of nn_train_parallel over the samples */
+struct NNParallel {
+	NeuralNetwork *nn;
+	float *input;			/* n_sample x n_input */
+	float *expect;			/* n_sample x n_output */
+	int n_sample;
+	float rate;
+	int batch;				/* Samples of a thread per step of NN_PARALLEL_SYNC */
+	int n_thread;
+	pthread_barrier_t barrier;
+	NNParallelWorker *workers;
+};
+
+static void _parallel_reduce(NNParallel *train, float *param, int n_param, int is_bias, float scale, int id);
+static void *_parallel_hogwild_func(void *data);
+static void *_parallel_sync_func(void *data);
+
+/*
+ * Apply the gradients of all threads to thread id's slice of the weight or the bias,
+ * they are summed in thread order and cleared for the next step
+ */
+static void
+_parallel_reduce(NNParallel *train, float *param, int n_param, int is_bias, float scale, int id)
+{
+	float *grad;
+	float sum;
+	int begin;
+	int end;
+	int i;
+	int t;
+
+	begin = (long)n_param * id / train->n_thread;
+	end = (long)n_param * (id + 1) / train->n_thread;
+	for (i = begin; i < end; i++)
+	{
+		sum = 0;
+		for (t = 0; t < train->n_thread; t++)
+		{
+			grad = is_bias ? train->workers[t].buf.grad_bias : train->workers[t].buf.grad_weight;
+			sum += grad[i];
+			grad[i] = 0;
+		}
+		param[i] += sum * scale;
+	}
+}
+
+static void *
+_parallel_hogwild_func(void *data)
+{
+	NNParallelWorker *worker;
+	NNParallel *train;
+	NeuralNetwork *nn;
+	int i;
+
+	worker = data;
+	train = worker->train;
+	nn = train->nn;
+
+	/*
+	 * Threads take every n_thread-th sample and race on the weights,
+	 * a lost correction is rare with sparse overlaps and costs less than a lock would
+	 */
+	for (i = worker->id; i < train->n_sample; i += train->n_thread)
+	{
+		nn_train_buffered(nn,
+				&worker->buf,
+				&train->input[(long)i * nn->n_input],
+				&train->expect[(long)i * nn->n_output],
+				train->rate);
+	}
+
+	return NULL;
+}
+
+static void *
+_parallel_sync_func(void *data)
+{
+	NNParallelWorker *worker;
+	NNParallel *train;
+	NeuralNetwork *nn;
+	int step;
+	int first;
+	int last;
+	int n_step;
+	int i;
+
+	worker = data;
+	train = worker->train;
+	nn = train->nn;
+
+	for (step = 0; step < train->n_sample; step += train->batch * train->n_thread)
+	{
+		/* 1. The gradient of this thread's part of the step, the weights are only read */
+		first = step + worker->id * train->batch;
+		last = first + train->batch;
+		if (last > train->n_sample)
+			last = train->n_sample;
+		for (i = first; i < last; i++)
+		{
+			nn_gradient_add(nn,
+					&worker->buf,
+					&train->input[(long)i * nn->n_input],
+					&train->expect[(long)i * nn->n_output]);
+		}
+		pthread_barrier_wait(&train->barrier);
+
+		/* 2. Every thread applies the mean gradient to its slice of the weights */
+		n_step = train->n_sample - step;
+		if (n_step > train->batch * train->n_thread)
+			n_step = train->batch * train->n_thread;
+		_parallel_reduce(train, nn->weight, nn->_n_weight, 0, train->rate / n_step, worker->id);
+		if (nn->use_bias)
+			_parallel_reduce(train, nn->bias, nn->_n_neuro, 1, train->rate / n_step, worker->id);
+		pthread_barrier_wait(&train->barrier);
+	}
+
+	return NULL;
+}
+
+/*
+ * Train nn once over n_sample samples with n_thread threads.
+ * NN_PARALLEL_SYNC takes steps of batch samples per thread and is reproducible for the same n_thread and batch,
+ * NN_PARALLEL_HOGWILD ignores batch and depends on how the threads interleave.
+ */
+int
+nn_train_parallel(NeuralNetwork *nn,
+		float *input,
+		float *expect,
+		int n_sample,
+		float rate,
+		int batch,
+		int n_thread,
+		NN_PARALLEL mode)
+{
+	NNParallel train;
+	int i;
+
+	if (n_sample < 1 || n_thread < 1)
+		return -1;
+	if (mode == NN_PARALLEL_SYNC && batch < 1)
+		return -1;
+
+	train.nn = nn;
+	train.input = input;
+	train.expect = expect;
+	train.n_sample = n_sample;
+	train.rate = rate;
+	train.batch = batch;
+	train.n_thread = n_thread;
+	train.workers = malloc(sizeof(NNParallelWorker) * n_thread);
+	pthread_barrier_init(&train.barrier, NULL, n_thread);
+
+	/* Set before the threads start, so Hogwild threads find it set and only ever read it */
+	nn->_packed_dirty = 1;
+
+	for (i = 0; i < n_thread; i++)
+	{
+		train.workers[i].id = i;
+		train.workers[i].train = &train;
+		nn_train_buffer_init(&train.workers[i].buf, nn, mode == NN_PARALLEL_SYNC);
+	}
+
+	for (i = 0; i < n_thread; i++)
+	{
+		pthread_create(&train.workers[i].thread,
+				NULL,
+				mode == NN_PARALLEL_SYNC ? _parallel_sync_func : _parallel_hogwild_func,
+				&train.workers[i]);
+	}
+
+	for (i = 0; i < n_thread; i++)
+	{
+		pthread_join(train.workers[i].thread, NULL);
+		nn_train_buffer_release(&train.workers[i].buf);
+	}
+
+	pthread_barrier_destroy(&train.barrier);
+	free(train.workers);
+
+	/* A pass is worth one repack, runs after it get the panels */
+	nn_pack(nn);
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef __NEURAL_NETWORK_PARALLEL_H
+#define __NEURAL_NETWORK_PARALLEL_H
+
+#include "neural_network.h"
+
+typedef enum {
+	NN_PARALLEL_HOGWILD,	/* Every thread corrects the shared weights after each of its samples, without locks */
+	NN_PARALLEL_SYNC,		/* Threads sum the gradient of their part of a batch, then apply the mean together */
+} NN_PARALLEL;
+
+int nn_train_parallel(NeuralNetwork *nn,
+		float *input,
+		float *expect,
+		int n_sample,
+		float rate,
+		int batch,
+		int n_thread,
+		NN_PARALLEL mode);
+
+#endif /* __NEURAL_NETWORK_PARALLEL_H */
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "neural_network.h"
+#include "neural_network_parallel.h"
+
+/* Samples and shape of the network the trainers are compared on */
+#define CHECK_N_SAMPLE	256
+#define CHECK_N_INPUT	6
+#define CHECK_N_OUTPUT	3
+
+static int _check_same(NeuralNetwork *a, NeuralNetwork *b);
+
+static int
+_check_same(NeuralNetwork *a, NeuralNetwork *b)
+{
+	if (memcmp(a->weight, b->weight, sizeof(float) * a->_n_weight))
+		return 0;
+	if (a->use_bias && memcmp(a->bias, b->bias, sizeof(float) * a->_n_neuro))
+		return 0;
+	return 1;
+}
+
+/*
+ * Train copies of a small network with nn_train and with nn_train_parallel on 1 thread,
+ * in NN_PARALLEL_SYNC mode with batches of 1 and in NN_PARALLEL_HOGWILD mode.
+ * All of them have to end bit for bit the same, and training has to have moved the weights.
+ */
+int
+main(void)
+{
+	NeuralNetwork *base;
+	NeuralNetwork *serial;
+	NeuralNetwork *sync;
+	NeuralNetwork *hogwild;
+	float *input;
+	float *expect;
+	int ret;
+	int i;
+	int j;
+
+	input = malloc(sizeof(float) * CHECK_N_SAMPLE * CHECK_N_INPUT);
+	expect = malloc(sizeof(float) * CHECK_N_SAMPLE * CHECK_N_OUTPUT);
+	for (i = 0; i < CHECK_N_SAMPLE; i++)
+	{
+		for (j = 0; j < CHECK_N_INPUT; j++)
+			input[i * CHECK_N_INPUT + j] = sinf(i * 0.37f + j);
+		for (j = 0; j < CHECK_N_OUTPUT; j++)
+			expect[i * CHECK_N_OUTPUT + j] = tanhf(input[i * CHECK_N_INPUT + j] * input[i * CHECK_N_INPUT + j + 1]);
+	}
+
+	base = nn_create(CHECK_N_INPUT, CHECK_N_OUTPUT, 2, 8, 1, ACT_FUNC_TYPE_TANH, ACT_FUNC_TYPE_LINEAR);
+	serial = nn_duplicate(base);
+	sync = nn_duplicate(base);
+	hogwild = nn_duplicate(base);
+
+	for (i = 0; i < CHECK_N_SAMPLE; i++)
+		nn_train(serial, &input[i * CHECK_N_INPUT], &expect[i * CHECK_N_OUTPUT], 0.01f);
+	nn_train_parallel(sync, input, expect, CHECK_N_SAMPLE, 0.01f, 1, 1, NN_PARALLEL_SYNC);
+	nn_train_parallel(hogwild, input, expect, CHECK_N_SAMPLE, 0.01f, 1, 1, NN_PARALLEL_HOGWILD);
+
+	ret = 0;
+	if (_check_same(serial, base))
+	{
+		printf("nn_train did not move the weights.\n");
+		ret = 1;
+	}
+	if (!_check_same(serial, sync))
+	{
+		printf("NN_PARALLEL_SYNC on 1 thread does not train like nn_train.\n");
+		ret = 1;
+	}
+	if (!_check_same(serial, hogwild))
+	{
+		printf("NN_PARALLEL_HOGWILD on 1 thread does not train like nn_train.\n");
+		ret = 1;
+	}
+	if (ret == 0)
+		printf("The parallel trainer on 1 thread trains like nn_train.\n");
+
+	nn_free(base);
+	nn_free(serial);
+	nn_free(sync);
+	nn_free(hogwild);
+	free(input);
+	free(expect);
+
+	return ret;
+}
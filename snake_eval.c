@@ -0,0 +1,453 @@
+#include "snake_eval.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Games a racing candidate plays before it is first judged, every later round doubles the games played */
+#define RACE_FIRST_GAMES	2
+/* One sided 99% quantile of the normal distribution the bound is taken at */
+#define RACE_Z				2.326f
+/* Candidates which played all their games before the pooled spread is trusted, until then none is cut */
+#define RACE_POOL_WARMUP	32
+/* The pooled variance is a running mean over about this many of the last candidates which played all games */
+#define RACE_POOL_WINDOW	64
+
+static int _eval_should_stop(SnakeEval *eval);
+static void _eval_cache_key(const float *observation, uint64_t *key);
+static SnakeEvalCacheSlot *_eval_cache_slot(SnakeEval *eval, const uint64_t *key);
+static void _eval_cache_next(SnakeEval *eval);
+static NeuralNetwork *_eval_network(SnakeEval *eval, NeuralNetwork *nn);
+static void _eval_play(SnakeEval *eval, NeuralNetwork *nn, const int *seeds, int first, int n_game);
+static void _eval_collect(SnakeEval *eval, int n_game, float *avg_performance, float *avg_score);
+static void _eval_moments(SnakeEval *eval, int n_game, float *mean, float *var);
+static float _eval_upper_bound(SnakeEval *eval, int n_played, int n_game);
+static void _eval_pool(SnakeEval *eval, int n_game);
+
+int
+snake_eval_argmax(float *arr, int len)
+{
+	int i;
+	float f_max = arr[0];
+	int i_max = 0;
+
+	for (i = 1; i < len; i++)
+	{
+		if (f_max < arr[i])
+		{
+			f_max = arr[i];
+			i_max = i;
+		}
+	}
+
+	return i_max;
+}
+
+static int
+_eval_should_stop(SnakeEval *eval)
+{
+	if (eval->stop == NULL)
+		return 0;
+
+	return *eval->stop;
+}
+
+static void
+_eval_cache_key(const float *observation, uint64_t *key)
+{
+	int i;
+
+	/* The basic observation is 8 distances within +-SNAKE_GAME_MAX_SIZE, 16 bits each */
+	key[0] = 0;
+	key[1] = 0;
+	for (i = 0; i < 4; i++)
+	{
+		key[0] |= (uint64_t)(uint16_t)(int)observation[i] << (i * 16);
+		key[1] |= (uint64_t)(uint16_t)(int)observation[i + 4] << (i * 16);
+	}
+}
+
+static SnakeEvalCacheSlot *
+_eval_cache_slot(SnakeEval *eval, const uint64_t *key)
+{
+	uint64_t h;
+
+	h = (key[0] ^ (key[1] * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+	return &eval->cache[(h >> 32) & eval->cache_mask];
+}
+
+/* A new network is evaluated, forget the decisions of the last one */
+static void
+_eval_cache_next(SnakeEval *eval)
+{
+	if (eval->cache == NULL)
+		return;
+
+	if (++eval->cache_stamp == 0)
+	{
+		memset(eval->cache, 0, sizeof(SnakeEvalCacheSlot) * (eval->cache_mask + 1));
+		eval->cache_stamp = 1;
+	}
+}
+
+/* The network to play with, nn folded when it has linear layers to fold */
+static NeuralNetwork *
+_eval_network(SnakeEval *eval, NeuralNetwork *nn)
+{
+	NeuralNetwork *folded;
+
+	folded = nn_fold(nn, eval->folded);
+	if (folded == NULL)
+		return nn;
+
+	eval->folded = folded;
+	return folded;
+}
+
+SnakeEval *
+snake_eval_create(const SnakeGameConfig *config, int n_game_max)
+{
+	SnakeEval *eval;
+	int i;
+
+	if (n_game_max < 1)
+		return NULL;
+
+	eval = malloc(sizeof(*eval));
+	eval->config = *config;
+	/* A network always makes the same move in the same state, so a loop is hunger already */
+	eval->config.detect_loop = 1;
+	eval->n_game_max = n_game_max;
+	eval->stop = NULL;
+
+	/* Games are reset for every run, so a run allocates nothing once they are warm */
+	eval->games = malloc(sizeof(SnakeGame *) * n_game_max);
+	for (i = 0; i < n_game_max; i++)
+		eval->games[i] = snake_game_create(&eval->config, 0);
+	eval->active = malloc(sizeof(int) * n_game_max);
+	eval->n_observation = snake_game_get_n_observation(config);
+	eval->observation = malloc(sizeof(float) * n_game_max * eval->n_observation);
+	eval->replays = malloc(sizeof(SnakeReplay *) * n_game_max);
+	for (i = 0; i < n_game_max; i++)
+		eval->replays[i] = snake_replay_create();
+	eval->best_game = 0;
+	eval->folded = NULL;
+	eval->action = malloc(sizeof(int) * n_game_max);
+	eval->miss = malloc(sizeof(int) * n_game_max);
+
+	eval->cache = NULL;
+	eval->cache_mask = 0;
+	eval->cache_stamp = 1;
+	eval->cache_lookup = 0;
+	eval->cache_hit = 0;
+
+	eval->race_var = 0;
+	eval->race_n_var = 0;
+	eval->race_played = 0;
+	eval->race_full = 0;
+
+	return eval;
+}
+
+void
+snake_eval_free(SnakeEval *eval)
+{
+	int i;
+
+	for (i = 0; i < eval->n_game_max; i++)
+	{
+		snake_game_free(eval->games[i]);
+		snake_replay_free(eval->replays[i]);
+	}
+	free(eval->replays);
+	free(eval->games);
+	free(eval->active);
+	free(eval->observation);
+	if (eval->folded)
+		nn_free(eval->folded);
+	free(eval->action);
+	free(eval->miss);
+	free(eval->cache);
+	free(eval);
+}
+
+/*
+ * Cache the network's decisions in n_slot slots, rounded up to a power of 2, 0 turns the cache off.
+ * Only observations of OBS_ENCODER_BASIC can be cached.
+ */
+int
+snake_eval_set_cache(SnakeEval *eval, int n_slot)
+{
+	int cap;
+
+	free(eval->cache);
+	eval->cache = NULL;
+	eval->cache_mask = 0;
+	if (n_slot <= 0)
+		return 0;
+	if (eval->config.obs_encoder != OBS_ENCODER_BASIC)
+		return -1;
+
+	cap = 1;
+	while (cap < n_slot)
+		cap <<= 1;
+
+	/* Stamp 0 is never a run's, so every slot starts empty */
+	eval->cache = calloc(cap, sizeof(SnakeEvalCacheSlot));
+	eval->cache_mask = cap - 1;
+	eval->cache_stamp = 1;
+
+	return 0;
+}
+
+/* Play the games first .. first + n_game - 1 in their slots, games before first are left alone */
+static void
+_eval_play(SnakeEval *eval, NeuralNetwork *nn, const int *seeds, int first, int n_game)
+{
+	int i;
+	int a;
+	int m;
+	int n_active;
+	int n_miss;
+	float *observation;
+	float *output;
+	uint64_t key[2];
+	SnakeEvalCacheSlot *slot;
+	SnakeGame *game;
+
+	/*
+	 * 1. Start every game of the batch
+	 */
+	for (i = 0; i < n_game; i++)
+	{
+		snake_game_reset(eval->games[first + i], seeds[first + i]);
+		eval->active[i] = first + i;
+		snake_replay_start(eval->replays[first + i], &eval->config, seeds[first + i]);
+	}
+	n_active = n_game;
+
+	/*
+	 * 2. Step all running games together
+	 */
+	while (n_active > 0 && !_eval_should_stop(eval))
+	{
+		/* Gather the observations the cache cannot answer into one matrix */
+		n_miss = 0;
+		for (a = 0; a < n_active; a++)
+		{
+			observation = &eval->observation[n_miss * eval->n_observation];
+			snake_game_get_observation(eval->games[eval->active[a]], observation);
+
+			if (eval->cache)
+			{
+				eval->cache_lookup++;
+				_eval_cache_key(observation, key);
+				slot = _eval_cache_slot(eval, key);
+				if (slot->stamp == eval->cache_stamp && slot->key[0] == key[0] && slot->key[1] == key[1])
+				{
+					eval->cache_hit++;
+					eval->action[a] = slot->action;
+					continue;
+				}
+			}
+
+			eval->miss[n_miss++] = a;
+		}
+
+		/* One forward pass for the whole batch */
+		if (n_miss > 0)
+		{
+			output = nn_run_batch(nn, eval->observation, n_miss);
+			for (m = 0; m < n_miss; m++)
+			{
+				a = eval->miss[m];
+				eval->action[a] = snake_eval_argmax(&output[m * nn->n_output], nn->n_output);
+				if (eval->cache)
+				{
+					_eval_cache_key(&eval->observation[m * eval->n_observation], key);
+					slot = _eval_cache_slot(eval, key);
+					slot->key[0] = key[0];
+					slot->key[1] = key[1];
+					slot->stamp = eval->cache_stamp;
+					slot->action = eval->action[a];
+				}
+			}
+		}
+
+		/* Scatter the actions back, drop the games which are over */
+		i = 0;
+		for (a = 0; a < n_active; a++)
+		{
+			game = eval->games[eval->active[a]];
+			snake_game_set_direction(game, eval->action[a], 1);
+			snake_replay_record(eval->replays[eval->active[a]], game->snake_dir);
+			snake_game_update(game, 1, 0);
+
+			if (!snake_game_is_over(game))
+				eval->active[i++] = eval->active[a];
+		}
+		n_active = i;
+	}
+
+	for (i = first; i < first + n_game; i++)
+		snake_replay_finish(eval->replays[i], eval->games[i]);
+}
+
+/* Average the first n_game games in game order */
+static void
+_eval_collect(SnakeEval *eval, int n_game, float *avg_performance, float *avg_score)
+{
+	int i;
+
+	*avg_score = 0;
+	*avg_performance = 0;
+	eval->best_game = 0;
+	for (i = 0; i < n_game; i++)
+	{
+		*avg_score += snake_game_get_score(eval->games[i]);
+		*avg_performance += snake_game_get_performance(eval->games[i]);
+		if (eval->replays[i]->performance > eval->replays[eval->best_game]->performance)
+			eval->best_game = i;
+	}
+
+	*avg_score /= (float)n_game;
+	*avg_performance /= (float)n_game;
+}
+
+/* Mean and sample variance of the performance of the first n_game games */
+static void
+_eval_moments(SnakeEval *eval, int n_game, float *mean, float *var)
+{
+	float d;
+	int i;
+
+	*mean = 0;
+	for (i = 0; i < n_game; i++)
+		*mean += snake_game_get_performance(eval->games[i]);
+	*mean /= (float)n_game;
+
+	*var = 0;
+	for (i = 0; i < n_game; i++)
+	{
+		d = snake_game_get_performance(eval->games[i]) - *mean;
+		*var += d * d;
+	}
+	*var /= (float)(n_game - 1);
+}
+
+/*
+ * How good the average of all n_game games could still turn out, judged from the first n_played.
+ * The games left are drawn around the mean so far, with the larger of the candidate's own spread
+ * and the spread pooled from the candidates which played all their games.
+ */
+static float
+_eval_upper_bound(SnakeEval *eval, int n_played, int n_game)
+{
+	float mean;
+	float var;
+	int n_left;
+
+	_eval_moments(eval, n_played, &mean, &var);
+	if (var < eval->race_var)
+		var = eval->race_var;
+
+	n_left = n_game - n_played;
+	return mean + RACE_Z * sqrtf(var * (1.0f / n_played + 1.0f / n_left)) * n_left / n_game;
+}
+
+/* A candidate played all n_game games, add its spread to the pool */
+static void
+_eval_pool(SnakeEval *eval, int n_game)
+{
+	float mean;
+	float var;
+	int n;
+
+	if (n_game < 2)
+		return;
+
+	_eval_moments(eval, n_game, &mean, &var);
+	n = eval->race_n_var < RACE_POOL_WINDOW ? eval->race_n_var + 1 : RACE_POOL_WINDOW;
+	eval->race_var += (var - eval->race_var) / (float)n;
+	eval->race_n_var++;
+}
+
+int
+snake_eval_run(SnakeEval *eval,
+		NeuralNetwork *nn,
+		const int *seeds,
+		int n_game,
+		float *avg_performance,
+		float *avg_score)
+{
+	if (n_game < 1 || n_game > eval->n_game_max)
+		return -1;
+
+	_eval_cache_next(eval);
+	_eval_play(eval, _eval_network(eval, nn), seeds, 0, n_game);
+	_eval_collect(eval, n_game, avg_performance, avg_score);
+
+	return 0;
+}
+
+/*
+ * Evaluate like snake_eval_run, but in rounds which double the games played.
+ * After every round the candidate drops out once even the upper confidence bound
+ * of its average over all n_game games is below threshold, the averages are then of the games played so far.
+ * A candidate whose average of the n_game games reaches threshold plays n_extra more games on
+ * the next seeds and is judged on all of them, so the games saved go to the ones in contention.
+ * Returns the number of games played.
+ */
+int
+snake_eval_race(SnakeEval *eval,
+		NeuralNetwork *nn,
+		const int *seeds,
+		int n_game,
+		int n_extra,
+		float threshold,
+		float *avg_performance,
+		float *avg_score)
+{
+	int n_played;
+	int n_round;
+
+	if (n_game < 1 || n_extra < 0 || n_game + n_extra > eval->n_game_max)
+		return -1;
+
+	_eval_cache_next(eval);
+	nn = _eval_network(eval, nn);
+	n_played = 0;
+	n_round = RACE_FIRST_GAMES < n_game ? RACE_FIRST_GAMES : n_game;
+	while (1)
+	{
+		_eval_play(eval, nn, seeds, n_played, n_round);
+		n_played += n_round;
+
+		if (n_played == n_game || _eval_should_stop(eval))
+			break;
+		if (eval->race_n_var >= RACE_POOL_WARMUP && _eval_upper_bound(eval, n_played, n_game) < threshold)
+			break;
+
+		n_round = n_played;
+		if (n_round > n_game - n_played)
+			n_round = n_game - n_played;
+	}
+
+	if (n_played == n_game)
+	{
+		_eval_pool(eval, n_game);
+		_eval_collect(eval, n_game, avg_performance, avg_score);
+		if (n_extra > 0 && *avg_performance >= threshold && !_eval_should_stop(eval))
+		{
+			_eval_play(eval, nn, seeds, n_game, n_extra);
+			n_played += n_extra;
+		}
+	}
+	_eval_collect(eval, n_played, avg_performance, avg_score);
+
+	eval->race_played += n_played;
+	eval->race_full += n_game;
+
+	return n_played;
+}
@@ -0,0 +1,86 @@
+#ifndef __SNAKE_EVAL_H
+#define __SNAKE_EVAL_H
+
+#include <stdint.h>
+
+#include "snake_game.h"
+#include "neural_network.h"
+#include "snake_replay.h"
+
+/* A decision of the network being evaluated, the key is the packed basic observation */
+typedef struct {
+	uint64_t key[2];
+	uint32_t stamp;		/* The slot only holds a decision while this is the evaluator's cache_stamp */
+	int action;
+} SnakeEvalCacheSlot;
+
+/*
+ * Lockstep evaluator.
+ * Plays several headless games with the same network at once,
+ * every step gathers the observations of all running games into one matrix
+ * and runs a single batched forward pass for them.
+ */
+typedef struct {
+	SnakeGameConfig config;
+	int n_game_max;		/* Capacity of the game slots */
+
+	/* Evaluation is aborted when this is set, ignored if NULL */
+	volatile int *stop;
+
+	SnakeGame **games;	/* One game per slot of the batch, reused by every run */
+	int *active;		/* Indices of the games which are still running */
+	int n_observation;	/* Values per observation */
+	float *observation;	/* n_game_max x n_observation */
+
+	/* Every game of the last run is recorded, best_game is the one with the best performance */
+	SnakeReplay **replays;
+	int best_game;
+
+	/* The network being evaluated with its linear layers folded, the genome itself stays as it is */
+	NeuralNetwork *folded;
+
+	int *action;		/* Action of every running game of a step */
+	int *miss;			/* Running games the cache could not answer */
+
+	/*
+	 * Decision cache, a network always makes the same move for the same observation.
+	 * Direct mapped, a miss overwrites the slot. NULL unless enabled with snake_eval_set_cache.
+	 */
+	SnakeEvalCacheSlot *cache;
+	int cache_mask;
+	uint32_t cache_stamp;	/* Bumped by every run, so the decisions of the last network go stale at once */
+	long cache_lookup;
+	long cache_hit;
+
+	/* Racing, the per game variance pooled from the candidates which played all their games */
+	float race_var;
+	int race_n_var;
+	long race_played;	/* Games the races played, extra games included */
+	long race_full;		/* Games the same candidates would have played without racing */
+} SnakeEval;
+
+SnakeEval *snake_eval_create(const SnakeGameConfig *config, int n_game_max);
+
+void snake_eval_free(SnakeEval *eval);
+
+int snake_eval_set_cache(SnakeEval *eval, int n_slot);
+
+int snake_eval_argmax(float *arr, int len);
+
+int snake_eval_run(SnakeEval *eval,
+		NeuralNetwork *nn,
+		const int *seeds,
+		int n_game,
+		float *avg_performance,
+		float *avg_score);
+
+int snake_eval_race(SnakeEval *eval,
+		NeuralNetwork *nn,
+		const int *seeds,
+		int n_game,
+		int n_extra,
+		float threshold,
+		float *avg_performance,
+		float *avg_score);
+
+#endif /* __SNAKE_EVAL_H */
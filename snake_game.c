@@ -3,6 +3,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+
+/* Redraws of food before falling back to the free cell index */
+#define FOOD_MAX_REDRAW	64
+/* Steps a new snapshot has room for, it grows with the snake */
+#define SNAPSHOT_BODY_CAP	64
 
 #ifndef ABS
 #define ABS(x)	((x) < 0 ? -(x) : (x))
@@ -13,8 +19,11 @@
 
 static int _point_is_overlap(Point *a, Point *b);
 static int _point_is_out_of_field(Point *p, int x, int y);
-static void _point_go_random(Point *p, int x, int y, MTRand *mtrand);
+static void _point_go_random(Point *p, int x, int y, SnakeRng *rng);
+static void _point_move(Point *p, DIRECTION dir);
+static DIRECTION _point_get_direction(Point *from, Point *to);
 
+static void _snake_reserve(SnakeGame *game, int len);
 static void _snake_eat(SnakeGame *game);
 static void _snake_move(SnakeGame *game);
 static int _snake_is_hitting_the_point(SnakeGame *game);
@@ -24,14 +33,34 @@ static int _snake_has_no_more_step_remain(SnakeGame *game);
 
 static int _game_should_update(SnakeGame *game);
 static void _game_point_go_random(SnakeGame *game);
+static void _game_rand_point(SnakeGame *game, Point *p);
 static void _game_over(SnakeGame *game, const char *reason);
+static int _game_get_cell(SnakeGame *game, Point *p);
+static void _game_cell_enter(SnakeGame *game, Point *p);
+static void _game_cell_leave(SnakeGame *game, Point *p);
+static void _game_free_cells_build(SnakeGame *game);
+static void _game_free_cells_take(SnakeGame *game, int cell);
+static void _game_free_cells_put(SnakeGame *game, int cell);
+static void _game_free_cells_dirty(SnakeGame *game, int pos);
+static void _game_free_cells_sync(SnakeGame *game, const int *free_cells, const int *slots, int n_slot);
 static void _game_compute_dist(SnakeGame *game);
+static uint64_t _loop_key(uint64_t x);
+static uint64_t _loop_state_hash(SnakeGame *game);
+static void _loop_restart(SnakeGame *game);
+static int _loop_is_saved_state(SnakeGame *game);
+static int _loop_check(SnakeGame *game);
+
+static void _snapshot_reserve_delta(SnakeGameSnapshot *snap, int n);
 
+static void _display_alloc(SnakeGame *game);
 static int _display_get_index(SnakeGame *game, int x, int y);
 static void _display_update_background(SnakeGame *game);
 static void _display_update_foreground(SnakeGame *game);
 static void _terminal_cursor_move(int x, int y);
 
+/* Stamps of snapshot contents, shared by every thread so a stamp names one content only */
+static atomic_ulong snapshot_stamp;
+
 static int
 _point_is_overlap(Point *a, Point *b)
 {
@@ -64,68 +93,122 @@ _point_is_out_of_field(Point *p, int x, int y)
 }
 
 static void
-_point_go_random(Point *p, int x, int y, MTRand *mtrand)
+_point_go_random(Point *p, int x, int y, SnakeRng *rng)
 {
-	p->x = genRandLong(mtrand) % x;
-	p->y = genRandLong(mtrand) % y;
+	p->x = snake_rng_next(rng) % x;
+	p->y = snake_rng_next(rng) % y;
+}
+
+static void
+_point_move(Point *p, DIRECTION dir)
+{
+	switch (dir)
+	{
+		case DIRECTION_UP:
+			p->y--;
+			break;
+
+		case DIRECTION_DOWN:
+			p->y++;
+			break;
+
+		case DIRECTION_LEFT:
+			p->x--;
+			break;
+
+		case DIRECTION_RIGHT:
+			p->x++;
+			break;
+
+		default:
+			break;
+	}
+}
+
+static DIRECTION
+_point_get_direction(Point *from, Point *to)
+{
+	/* from and to are expected to be next to each other */
+	if (to->y < from->y)
+		return DIRECTION_UP;
+	if (to->y > from->y)
+		return DIRECTION_DOWN;
+	if (to->x < from->x)
+		return DIRECTION_LEFT;
+	return DIRECTION_RIGHT;
+}
+
+static void
+_snake_reserve(SnakeGame *game, int len)
+{
+	Point *body;
+	int cap;
+	int i;
+
+	if (len <= game->snake_body_cap)
+		return;
+
+	cap = game->snake_body_cap;
+	while (cap < len)
+		cap *= 2;
+
+	/* Unwrap the ring so the head is at slot 0 again */
+	body = malloc(sizeof(Point) * cap);
+	for (i = 0; i < game->snake_body_cap; i++)
+		body[i] = SNAKE_GAME_BODY(game, i);
+
+	free(game->snake_body);
+	game->snake_body = body;
+	game->snake_body_cap = cap;
+	game->snake_head = 0;
 }
 
 static void
 _snake_eat(SnakeGame *game)
 {
-	int step_used;
+	_snake_reserve(game, game->snake_len + 1);
 	game->snake_len++;
 	game->total_step_used += game->max_step - game->snake_step_remain;
 	game->total_step_to_food += game->init_step_to_food;
 
 	game->snake_step_remain = game->max_step;
+	if (game->loop)
+		_loop_restart(game);
 	/*
 	 * Initialize the last tail point by -1,
 	 * -1 to skip display update until the snake move and give the point a reasonable x, y
 	 */
-	game->snake_body[game->snake_len - 1].x = -1;
-	game->snake_body[game->snake_len - 1].y = -1;
+	SNAKE_GAME_BODY(game, game->snake_len - 1).x = -1;
+	SNAKE_GAME_BODY(game, game->snake_len - 1).y = -1;
 }
 
 static void
 _snake_move(SnakeGame *game)
 {
-	int i;
+	Point head;
+	Point tail;
 
 	if (game->snake_dir == DIRECTION_NONE)
 		return;
 
+	tail = SNAKE_GAME_BODY(game, game->snake_len - 1);
+	head = SNAKE_GAME_BODY(game, 0);
+	_point_move(&head, game->snake_dir);
+
 	/*
-	 * Index from the snake tail(len - 1)
-	 * to the point next to snake head(1)
+	 * Move the snake by stepping the head back one slot of the ring,
+	 * every segment becomes the next one and the tail drops off the end
 	 */
-	for (i = game->snake_len - 1; i > 0; i--)
-	{
-		/* Move the snake by updating its body to its next position */
-		game->snake_body[i] = game->snake_body[i - 1];
-	}
+	game->snake_head = (game->snake_head - 1) & (game->snake_body_cap - 1);
+	SNAKE_GAME_BODY(game, 0) = head;
 
-	/* The snake head(0) */
-	switch (game->snake_dir)
+	/* The tail leaves its cell before the head takes one */
+	_game_cell_leave(game, &tail);
+	_game_cell_enter(game, &head);
+	if (game->obs)
 	{
-		case DIRECTION_UP:
-			game->snake_body[0].y--;
-			break;
-
-		case DIRECTION_DOWN:
-			game->snake_body[0].y++;
-			break;
-
-		case DIRECTION_LEFT:
-			game->snake_body[0].x--;
-			break;
-
-		case DIRECTION_RIGHT:
-			game->snake_body[0].x++;
-			break;
-
-		default:
-			break;
+		snake_obs_unset(game->obs, tail.x, tail.y);
+		snake_obs_set(game->obs, head.x, head.y);
 	}
 
 	game->snake_step_remain--;
@@ -134,26 +217,19 @@ _snake_move(SnakeGame *game)
 static int
 _snake_is_hitting_the_point(SnakeGame *game)
 {
-	return _point_is_overlap(&game->pt, &game->snake_body[0]);
+	return _point_is_overlap(&game->pt, &SNAKE_GAME_BODY(game, 0));
 }
 
 static int
 _snake_is_hitting_the_wall(SnakeGame *game)
 {
-	return _point_is_out_of_field(&game->snake_body[0], game->size_x, game->size_y);
+	return _point_is_out_of_field(&SNAKE_GAME_BODY(game, 0), game->size_x, game->size_y);
 }
 
 static int
 _snake_is_hitting_itself(SnakeGame *game)
 {
-	int i;
-	for (i = 1; i < game->snake_len; i++)
-	{
-		if (_point_is_overlap(&game->snake_body[0], &game->snake_body[i]))
-			return 1;
-	}
-
-	return 0;
+	return game->snake_hit_itself;
 }
 
 static int
@@ -172,57 +248,257 @@ _game_should_update(SnakeGame *game)
 
 	/* Check how many time passed */
 	gettimeofday(&tv_now, NULL);
-	if (TV_USEC_DIFF(&game->tv_last_step, &tv_now) < 1000000 / game->step_per_sec)
+	if (TV_USEC_DIFF(&game->cold->tv_last_step, &tv_now) < 1000000 / game->cold->step_per_sec)
 		return 0;	/* Return 0 because it's not the time yet */
 
 	/* Update the timestamp and return 1 */
-	game->tv_last_step = tv_now;
+	game->cold->tv_last_step = tv_now;
 	return 1;
 }
 
 static void
 _game_point_go_random(SnakeGame *game)
 {
-	char c;
+	int i;
+	int cell;
+	int n_cell;
 
-	/*
-	 * Prevent the next random point position is in the snake body
-	 */
-	_point_go_random(&game->pt, game->size_x, game->size_y, &game->mtrand);
-	c = game->display_bg[_display_get_index(game, game->pt.x, game->pt.y)];
-	while (c != ' ' && c != '\0')
+	if (game->food_mode == FOOD_MODE_FREE_CELL)
+	{
+		n_cell = game->size_x * game->size_y;
+		if (game->snake_cells.n == n_cell)
+		{
+			_game_over(game, "The snake filled the field.");
+			return;
+		}
+
+		if (!game->free_index && game->snake_cells.n * 2 >= n_cell)
+			_game_free_cells_build(game);
+
+		if (!game->free_index)
+		{
+			/* At least half of the field is free, so this takes 2 draws at most on average */
+			for (i = 0; i < FOOD_MAX_REDRAW; i++)
+			{
+				cell = snake_rng_next(&game->cold->rng) % n_cell;
+				if (cell_map_get(&game->snake_cells, cell) == 0)
+					break;
+			}
+
+			/* A generator stuck on few numbers, like the one of seed 0, may never hit a free cell */
+			if (i == FOOD_MAX_REDRAW)
+				_game_free_cells_build(game);
+		}
+
+		if (game->free_index)
+		{
+			/* One draw picks any free cell with the same chance */
+			cell = game->free_cells[snake_rng_next(&game->cold->rng) % game->n_free];
+		}
+		game->pt.x = cell % game->size_x;
+		game->pt.y = cell / game->size_x;
+	}
+	else
 	{
-		_point_go_random(&game->pt, game->size_x, game->size_y, &game->mtrand);
-		c = game->display_bg[_display_get_index(game, game->pt.x, game->pt.y)];
+		/*
+		 * Legacy placement is a single random cell, which may be under the snake.
+		 * It used to retry on the drawn display, which only headless games never had,
+		 * so a shown game placed food differently from the same game in training.
+		 */
+		_game_rand_point(game, &game->pt);
 	}
 
-	game->init_step_to_food = ABS(game->pt.x - game->snake_body[0].x) + ABS(game->pt.y - game->snake_body[0].y);
+	game->init_step_to_food = ABS(game->pt.x - SNAKE_GAME_BODY(game, 0).x) + ABS(game->pt.y - SNAKE_GAME_BODY(game, 0).y);
+}
+
+static void
+_game_rand_point(SnakeGame *game, Point *p)
+{
+	_point_go_random(p, game->size_x, game->size_y, &game->cold->rng);
 }
 
 static void
 _game_over(SnakeGame *game, const char *reason)
 {
 	if (reason)
-		strncpy(game->game_over_reason, reason, sizeof(game->game_over_reason));
+		snprintf(game->cold->game_over_reason, sizeof(game->cold->game_over_reason), "%s", reason);
 
 	game->game_over = 1;
 }
 
+static int
+_game_get_cell(SnakeGame *game, Point *p)
+{
+	if (_point_is_out_of_field(p, game->size_x, game->size_y))
+		return -1;
+
+	return p->y * game->size_x + p->x;
+}
+
+static void
+_game_cell_enter(SnakeGame *game, Point *p)
+{
+	int cell;
+
+	cell = _game_get_cell(game, p);
+	if (cell < 0)
+		return;
+	if (game->loop)
+		game->loop->body_hash ^= _loop_key(cell);
+
+	/* Landing on a cell the body still covers is hitting itself */
+	if (cell_map_add(&game->snake_cells, cell) == 1)
+	{
+		if (game->free_index)
+			_game_free_cells_take(game, cell);
+	}
+	else
+	{
+		game->snake_hit_itself = 1;
+	}
+}
+
+static void
+_game_cell_leave(SnakeGame *game, Point *p)
+{
+	int cell;
+
+	/* Segments grown by eating are at (-1, -1) and cover no cell */
+	cell = _game_get_cell(game, p);
+	if (cell < 0)
+		return;
+	if (game->loop)
+		game->loop->body_hash ^= _loop_key(cell);
+
+	if (cell_map_remove(&game->snake_cells, cell) == 0 && game->free_index)
+		_game_free_cells_put(game, cell);
+}
+
+static void
+_game_free_cells_build(SnakeGame *game)
+{
+	int n_cell;
+	int cell;
+	int i;
+
+	/* The arrays are kept when the game is reset */
+	n_cell = game->size_x * game->size_y;
+	if (game->free_cells == NULL)
+	{
+		game->free_cells = malloc(sizeof(int) * n_cell);
+		game->free_pos = malloc(sizeof(int) * n_cell);
+	}
+	game->free_index = 1;
+	game->n_free = n_cell;
+	game->free_stamp = 0;
+	for (i = 0; i < n_cell; i++)
+	{
+		game->free_cells[i] = i;
+		game->free_pos[i] = i;
+	}
+
+	/* Take the cells from the head to the tail so the order only depends on the snake */
+	for (i = 0; i < game->snake_len; i++)
+	{
+		cell = _game_get_cell(game, &SNAKE_GAME_BODY(game, i));
+		if (cell >= 0)
+			_game_free_cells_take(game, cell);
+	}
+}
+
+static void
+_game_free_cells_take(SnakeGame *game, int cell)
+{
+	int pos;
+	int last;
+
+	pos = game->free_pos[cell];
+	if (pos >= game->n_free)
+		return;	/* Already taken */
+
+	/* Swap with the last free cell and shrink the free part */
+	game->n_free--;
+	last = game->free_cells[game->n_free];
+	game->free_cells[pos] = last;
+	game->free_pos[last] = pos;
+	game->free_cells[game->n_free] = cell;
+	game->free_pos[cell] = game->n_free;
+	_game_free_cells_dirty(game, pos);
+	_game_free_cells_dirty(game, game->n_free);
+}
+
+static void
+_game_free_cells_put(SnakeGame *game, int cell)
+{
+	int pos;
+	int first;
+
+	pos = game->free_pos[cell];
+	if (pos < game->n_free)
+		return;	/* Already free */
+
+	/* Swap with the first taken cell and grow the free part */
+	first = game->free_cells[game->n_free];
+	game->free_cells[pos] = first;
+	game->free_pos[first] = pos;
+	game->free_cells[game->n_free] = cell;
+	game->free_pos[cell] = game->n_free;
+	_game_free_cells_dirty(game, pos);
+	_game_free_cells_dirty(game, game->n_free);
+	game->n_free++;
+}
+
+/* Note a changed slot of free_cells while the index still matches a snapshot */
+static void
+_game_free_cells_dirty(SnakeGame *game, int pos)
+{
+	if (game->free_stamp == 0)
+		return;
+
+	if (game->n_free_dirty == game->free_dirty_cap)
+	{
+		/* Past a quarter of the field copying all of it costs about the same */
+		if (game->free_dirty_cap >= game->size_x * game->size_y / 4)
+		{
+			game->free_stamp = 0;
+			return;
+		}
+		game->free_dirty_cap = game->free_dirty_cap ? game->free_dirty_cap * 2 : 16;
+		game->free_dirty = realloc(game->free_dirty, sizeof(int) * game->free_dirty_cap);
+	}
+	game->free_dirty[game->n_free_dirty++] = pos;
+}
+
+/* Take the slots of free_cells, then point free_pos at the cells which moved into them */
+static void
+_game_free_cells_sync(SnakeGame *game, const int *free_cells, const int *slots, int n_slot)
+{
+	int i;
+
+	for (i = 0; i < n_slot; i++)
+		game->free_cells[slots[i]] = free_cells[slots[i]];
+	for (i = 0; i < n_slot; i++)
+		game->free_pos[game->free_cells[slots[i]]] = slots[i];
+}
+
 static void
 _game_compute_dist(SnakeGame *game)
 {
 	int i;
+	Point head;
+	Point *body;
 	int dist_to_wall[4];
 	int dist_to_body[4];
+	head = SNAKE_GAME_BODY(game, 0);
 	/* 4 directions to wall */
 	/* UP */
-	dist_to_wall[0] = game->snake_body[0].y;
+	dist_to_wall[0] = head.y;
 	/* DOWN */
-	dist_to_wall[1] = game->size_y - game->snake_body[0].y - 1;
+	dist_to_wall[1] = game->size_y - head.y - 1;
 	/* LEFT */
-	dist_to_wall[2] = game->snake_body[0].x;
+	dist_to_wall[2] = head.x;
 	/* RIGHT */
-	dist_to_wall[3] = game->size_x - game->snake_body[0].x - 1;
+	dist_to_wall[3] = game->size_x - head.x - 1;
 
 	dist_to_body[0] = game->size_y;
 	dist_to_body[1] = game->size_y;
@@ -232,8 +508,9 @@ _game_compute_dist(SnakeGame *game)
 	{
 		int dist_x;
 		int dist_y;
-		dist_x = game->snake_body[0].x - game->snake_body[i].x;
-		dist_y = game->snake_body[0].y - game->snake_body[i].y;
+		body = &SNAKE_GAME_BODY(game, i);
+		dist_x = head.x - body->x;
+		dist_y = head.y - body->y;
 
 		if (dist_x == 0)
 		{
@@ -270,9 +547,9 @@ _game_compute_dist(SnakeGame *game)
 			}
 		}
 	}
-	game->dist_to_food[1] = game->pt.y - game->snake_body[0].y;
+	game->dist_to_food[1] = game->pt.y - head.y;
 	game->dist_to_food[0] = -game->dist_to_food[1];
-	game->dist_to_food[3] = game->pt.x - game->snake_body[0].x;
+	game->dist_to_food[3] = game->pt.x - head.x;
 	game->dist_to_food[2] = -game->dist_to_food[3];
 
 	game->dist_to_hit[0] = MIN(dist_to_wall[0], dist_to_body[0]);
@@ -281,6 +558,100 @@ _game_compute_dist(SnakeGame *game)
 	game->dist_to_hit[3] = MIN(dist_to_wall[3], dist_to_body[3]);
 }
 
+static uint64_t
+_loop_key(uint64_t x)
+{
+	/* splitmix64's finalizer, cells next to each other get unrelated keys */
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+static uint64_t
+_loop_state_hash(SnakeGame *game)
+{
+	uint64_t head;
+
+	/* The body hash is of a set of cells, the head and direction give it its order back mostly */
+	head = (uint64_t)(SNAKE_GAME_BODY(game, 0).y + 1) * (SNAKE_GAME_MAX_SIZE + 2) + SNAKE_GAME_BODY(game, 0).x + 1;
+	return game->loop->body_hash ^ _loop_key((head << 3 | game->snake_dir) ^ 0x5a5a5a5a5a5a5a5aull);
+}
+
+/* Forget the saved state, after a meal or when the game was set to another state */
+static void
+_loop_restart(SnakeGame *game)
+{
+	game->loop->saved_len = 0;
+	game->loop->power = 1;
+	game->loop->lam = 0;
+}
+
+static int
+_loop_is_saved_state(SnakeGame *game)
+{
+	SnakeGameLoop *loop;
+	int i;
+
+	loop = game->loop;
+	if (loop->saved_len != game->snake_len || loop->saved_dir != game->snake_dir)
+		return 0;
+
+	for (i = 0; i < game->snake_len; i++)
+	{
+		if (!_point_is_overlap(&loop->saved_body[i], &SNAKE_GAME_BODY(game, i)))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Returns 1 if the current state was seen since the last meal */
+static int
+_loop_check(SnakeGame *game)
+{
+	SnakeGameLoop *loop;
+	uint64_t hash;
+	int i;
+
+	loop = game->loop;
+	hash = _loop_state_hash(game);
+	if (loop->saved_len && hash == loop->saved_hash && _loop_is_saved_state(game))
+		return 1;
+
+	if (++loop->lam < loop->power)
+		return 0;
+
+	/* Brent: save this state and wait twice as long for it to come back */
+	if (loop->saved_cap < game->snake_len)
+	{
+		loop->saved_cap = game->snake_body_cap;
+		loop->saved_body = realloc(loop->saved_body, sizeof(Point) * loop->saved_cap);
+	}
+	for (i = 0; i < game->snake_len; i++)
+		loop->saved_body[i] = SNAKE_GAME_BODY(game, i);
+	loop->saved_len = game->snake_len;
+	loop->saved_dir = game->snake_dir;
+	loop->saved_hash = hash;
+	loop->power *= 2;
+	loop->lam = 0;
+
+	return 0;
+}
+
+static void
+_display_alloc(SnakeGame *game)
+{
+	if (game->cold->display_bg)
+		return;
+
+	/* So many characters for display */
+	game->cold->display_bg = malloc(sizeof(char) * game->size_x * game->size_y);
+	game->cold->display_fg = malloc(sizeof(char) * game->size_x * game->size_y);
+	memset(game->cold->display_bg, ' ', game->size_x * game->size_y);
+	memset(game->cold->display_fg, ' ', game->size_x * game->size_y);
+}
+
 static int
 _display_get_index(SnakeGame *game, int x, int y)
 {
@@ -291,13 +662,14 @@ static void
 _display_update_background(SnakeGame *game)
 {
 	int i;
+	Point *body;
 	char snake_head_char = 'O';
 	char snake_body_char = 'o';
 
 	/*
 	 * 0. Initialize whole display
 	 */
-	memset(game->display_bg, ' ', game->size_x * game->size_y);
+	memset(game->cold->display_bg, ' ', game->size_x * game->size_y);
 
 	/*
 	 * 1. Draw the snake
@@ -309,24 +681,26 @@ _display_update_background(SnakeGame *game)
 		snake_head_char = 'X';
 	}
 	/* The snake head */
-	if (!_point_is_out_of_field(&game->snake_body[0], game->size_x, game->size_y))
-		game->display_bg[_display_get_index(game, game->snake_body[0].x, game->snake_body[0].y)] = snake_head_char;
+	body = &SNAKE_GAME_BODY(game, 0);
+	if (!_point_is_out_of_field(body, game->size_x, game->size_y))
+		game->cold->display_bg[_display_get_index(game, body->x, body->y)] = snake_head_char;
 	/* The snake body
 	 * i = 1: Skip the head we already draw
 	 */
 	for (i = 1; i < game->snake_len; i++)
 	{
 		/* Skip the point which is out of field */
-		if (_point_is_out_of_field(&game->snake_body[i], game->size_x, game->size_y))
+		body = &SNAKE_GAME_BODY(game, i);
+		if (_point_is_out_of_field(body, game->size_x, game->size_y))
 			continue;
 
-		game->display_bg[_display_get_index(game, game->snake_body[i].x, game->snake_body[i].y)] = snake_body_char;
+		game->cold->display_bg[_display_get_index(game, body->x, body->y)] = snake_body_char;
 	}
 
 	/*
 	 * 2. Draw the point
 	 */
-	game->display_bg[_display_get_index(game, game->pt.x, game->pt.y)] = '*';
+	game->cold->display_bg[_display_get_index(game, game->pt.x, game->pt.y)] = '*';
 }
 
 static void
@@ -342,7 +716,7 @@ _display_update_foreground(SnakeGame *game)
 		for (x = 0; x < game->size_x; x++)
 		{
 			char_index = _display_get_index(game, x, y);
-			if (game->display_fg[char_index] != game->display_bg[char_index])
+			if (game->cold->display_fg[char_index] != game->cold->display_bg[char_index])
 			{
 				/*
 				 * Move terminal cursor
@@ -351,10 +725,10 @@ _display_update_foreground(SnakeGame *game)
 				_terminal_cursor_move(x + 2, y + 2);
 
 				/* Print */
-				putchar(game->display_bg[char_index]);
+				putchar(game->cold->display_bg[char_index]);
 
 				/* Display update */
-				game->display_fg[char_index] = game->display_bg[char_index];
+				game->cold->display_fg[char_index] = game->cold->display_bg[char_index];
 			}
 		}
 	}
@@ -383,54 +757,126 @@ _terminal_cursor_move(int x, int y)
 }
 
 SnakeGame *
-snake_game_create(int x, int y, int step_per_sec, int max_step, int seed)
+snake_game_create(const SnakeGameConfig *config, int seed)
 {
 	SnakeGame *ng;
+	int x;
+	int y;
 
-	if (x < 0 || y < 0)
+	x = config->size_x;
+	y = config->size_y;
+	if (x < 1 || y < 1 || x > SNAKE_GAME_MAX_SIZE || y > SNAKE_GAME_MAX_SIZE)
 		return NULL;
 
-	ng = malloc(sizeof(SnakeGame));
+	/* Start on a cache line so the hot fields share as few lines as possible */
+	if (posix_memalign((void **)&ng, 64, sizeof(SnakeGame)))
+		return NULL;
+	ng->cold = malloc(sizeof(SnakeGameCold));
 
 	/* Initialize the game info */
-	gettimeofday(&ng->tv_last_step, NULL);
-	ng->step_per_sec = step_per_sec;
-	ng->total_step_to_food = 0;
-	ng->total_step_used = 0;
-	ng->max_step = max_step;
-	ng->game_over = 0;
+	ng->cold->step_per_sec = config->step_per_sec;
+	ng->max_step = config->max_step;
 	ng->size_x = x;
 	ng->size_y = y;
+	ng->food_mode = config->food_mode;
+
+	/* The snake's memory grows with its length instead of the field */
+	ng->snake_body_cap = 16;
+	ng->snake_body = malloc(sizeof(Point) * ng->snake_body_cap);
+	cell_map_init(&ng->snake_cells, 16);
+	snake_rng_init(&ng->cold->rng, config->rng);
+
+	ng->cold->display_bg = NULL;
+	ng->cold->display_fg = NULL;
+	ng->free_cells = NULL;
+	ng->free_pos = NULL;
+	ng->free_dirty = NULL;
+	ng->free_dirty_cap = 0;
+
+	ng->n_observation = snake_game_get_n_observation(config);
+	ng->obs = snake_obs_create(config->obs_encoder, config->obs_vision_size, x, y);
+
+	ng->loop = NULL;
+	if (config->detect_loop)
+	{
+		ng->loop = malloc(sizeof(SnakeGameLoop));
+		ng->loop->saved_body = NULL;
+		ng->loop->saved_cap = 0;
+	}
 
-	/* Initailize the snake */
-	ng->snake_body = malloc(sizeof(Point) * x * y);
-	ng->snake_len = 1;
-	ng->snake_dir = DIRECTION_NONE;
-	ng->snake_step_remain = ng->max_step;
-	ng->mtrand = seedRand(seed);
-	_point_go_random(&ng->snake_body[0], ng->size_x, ng->size_y, &ng->mtrand);
+	snake_game_reset(ng, seed);
 
-	//_point_go_random(&ng->pt, ng->size_x, ng->size_y, &ng->mtrand);
+	return ng;
+}
 
-	/* So many characters for display */
-	ng->display_bg = malloc(sizeof(char) * x * y);
-	ng->display_fg = malloc(sizeof(char) * x * y);
-	memset(ng->display_bg, ' ', ng->size_x * ng->size_y);
-	memset(ng->display_fg, ' ', ng->size_x * ng->size_y);
+void
+snake_game_reset(SnakeGame *game, int seed)
+{
+	/* The first update of a timed game is due right away */
+	game->cold->tv_last_step.tv_sec = 0;
+	game->cold->tv_last_step.tv_usec = 0;
+	game->total_step_to_food = 0;
+	game->total_step_used = 0;
+	game->game_over = 0;
+	game->cold->game_over_reason[0] = '\0';
 
-	_game_point_go_random(ng);
-	_game_compute_dist(ng);
+	/* Initailize the snake */
+	game->snake_head = 0;
+	game->snake_len = 1;
+	game->snake_dir = DIRECTION_NONE;
+	game->snake_step_remain = game->max_step;
+	game->snake_hit_itself = 0;
+	cell_map_clear(&game->snake_cells);
+	if (game->loop)
+	{
+		game->loop->body_hash = 0;
+		_loop_restart(game);
+	}
+	snake_rng_seed(&game->cold->rng, seed);
+	_game_rand_point(game, &game->snake_body[0]);
 
-	return ng;
+	/* Buffers of the last episode are kept, they are rebuilt when needed */
+	if (game->cold->display_bg)
+	{
+		memset(game->cold->display_bg, ' ', game->size_x * game->size_y);
+		memset(game->cold->display_fg, ' ', game->size_x * game->size_y);
+	}
+	game->free_index = 0;
+	game->n_free = 0;
+	game->n_free_dirty = 0;
+	game->free_stamp = 0;
+	_game_cell_enter(game, &game->snake_body[0]);
+
+	if (game->obs)
+	{
+		snake_obs_clear(game->obs);
+		snake_obs_set(game->obs, game->snake_body[0].x, game->snake_body[0].y);
+	}
+
+	_game_point_go_random(game);
+	_game_compute_dist(game);
 }
 
 void
 snake_game_free(SnakeGame *game)
 {
 	free(game->snake_body);
-	free(game->display_bg);
-	free(game->display_fg);
+	free(game->cold->display_bg);
+	free(game->cold->display_fg);
+	free(game->free_cells);
+	free(game->free_pos);
+	free(game->free_dirty);
+	cell_map_release(&game->snake_cells);
+	snake_rng_release(&game->cold->rng);
+	if (game->obs)
+		snake_obs_free(game->obs);
+	if (game->loop)
+	{
+		free(game->loop->saved_body);
+		free(game->loop);
+	}
 
+	free(game->cold);
 	free(game);
 }
 
@@ -498,11 +944,17 @@ snake_game_update(SnakeGame *game, int no_wait, int update_display)
 	{
 		_game_over(game, "The snake died because of hunger.");
 	}
+	else if (game->loop && _loop_check(game))
+	{
+		/* It would circle the same way until it starves, nothing else can happen on the way */
+		_game_over(game, "The snake died because of hunger.");
+	}
 
 	/* Draw the display in the background */
 	if (!update_display)
 		return;
 
+	_display_alloc(game);
 	_display_update_background(game);
 
 	/*
@@ -521,8 +973,9 @@ snake_game_show(SnakeGame *game)
 	/* Clear screen and show once */
 	system("clear");
 
+	_display_alloc(game);
 	_display_update_background(game);
-	memcpy(game->display_fg, game->display_bg, sizeof(char) * game->size_x * game->size_y);
+	memcpy(game->cold->display_fg, game->cold->display_bg, sizeof(char) * game->size_x * game->size_y);
 
 	/* Upper border */
 	putchar('+');
@@ -540,7 +993,7 @@ snake_game_show(SnakeGame *game)
 		for (x = 0; x < game->size_x; x++)
 		{
 			char_index = _display_get_index(game, x, y);
-			putchar(game->display_fg[char_index]);
+			putchar(game->cold->display_fg[char_index]);
 		}
 		/* Right border */
 		putchar('|');
@@ -580,10 +1033,10 @@ const char *
 snake_game_get_game_over_reason(SnakeGame *game)
 {
 	/* The string is empty, no game over reason yet */
-	if (game->game_over_reason[0] == '\0')
+	if (game->cold->game_over_reason[0] == '\0')
 		return NULL;
 
-	return game->game_over_reason;
+	return game->cold->game_over_reason;
 }
 
 float
@@ -601,3 +1054,301 @@ snake_game_get_performance(SnakeGame *game)
 	return performance;
 	//return ((float)(score) * (float)game->total_step_to_food) / (float)game->total_step_used;
 }
+
+int
+snake_game_get_n_observation(const SnakeGameConfig *config)
+{
+	return snake_obs_get_n(config->obs_encoder, config->obs_vision_size);
+}
+
+void
+snake_game_get_observation(SnakeGame *game, float *obs)
+{
+	obs[0] = game->dist_to_hit[0];
+	obs[1] = game->dist_to_hit[1];
+	obs[2] = game->dist_to_hit[2];
+	obs[3] = game->dist_to_hit[3];
+	obs[4] = game->dist_to_food[0];
+	obs[5] = game->dist_to_food[1];
+	obs[6] = game->dist_to_food[2];
+	obs[7] = game->dist_to_food[3];
+
+	if (game->obs)
+	{
+		snake_obs_encode(game->obs,
+				SNAKE_GAME_BODY(game, 0).x,
+				SNAKE_GAME_BODY(game, 0).y,
+				game->pt.x,
+				game->pt.y,
+				&obs[SNAKE_OBS_N_BASIC]);
+	}
+}
+
+SnakeGameSnapshot *
+snake_game_snapshot_create(const SnakeGameConfig *config)
+{
+	SnakeGameSnapshot *snap;
+	int x;
+	int y;
+
+	x = config->size_x;
+	y = config->size_y;
+	if (x < 1 || y < 1 || x > SNAKE_GAME_MAX_SIZE || y > SNAKE_GAME_MAX_SIZE)
+		return NULL;
+
+	/* Like the game, the snapshot grows with the snake instead of taking the field up front */
+	snap = malloc(sizeof(*snap));
+	snap->size_x = x;
+	snap->size_y = y;
+	snake_rng_init(&snap->rng, config->rng);
+	snap->body_cap = SNAPSHOT_BODY_CAP;
+	snap->body = malloc(snap->body_cap / 4);
+	snap->n_free = -1;
+	snap->free_cells = NULL;
+	snap->stamp = 0;
+	snap->prev_stamp = 0;
+	snap->free_delta = NULL;
+	snap->n_free_delta = 0;
+	snap->free_delta_cap = 0;
+
+	return snap;
+}
+
+void
+snake_game_snapshot_free(SnakeGameSnapshot *snap)
+{
+	snake_rng_release(&snap->rng);
+	free(snap->body);
+	free(snap->free_cells);
+	free(snap->free_delta);
+	free(snap);
+}
+
+static void
+_snapshot_reserve_delta(SnakeGameSnapshot *snap, int n)
+{
+	if (n <= snap->free_delta_cap)
+		return;
+
+	snap->free_delta_cap = snap->free_delta_cap ? snap->free_delta_cap : 16;
+	while (snap->free_delta_cap < n)
+		snap->free_delta_cap *= 2;
+	snap->free_delta = realloc(snap->free_delta, sizeof(int) * snap->free_delta_cap);
+}
+
+int
+snake_game_snapshot(SnakeGame *game, SnakeGameSnapshot *snap)
+{
+	int i;
+	int n_step;
+	unsigned long stamp;
+	Point *body;
+
+	if (game->size_x != snap->size_x || game->size_y != snap->size_y)
+		return -1;
+
+	snap->food_mode = game->food_mode;
+	snap->max_step = game->max_step;
+	snap->init_step_to_food = game->init_step_to_food;
+	snap->total_step_to_food = game->total_step_to_food;
+	snap->total_step_used = game->total_step_used;
+	snap->game_over = game->game_over;
+	if (game->game_over)
+		memcpy(snap->game_over_reason, game->cold->game_over_reason, sizeof(snap->game_over_reason));
+	else
+		snap->game_over_reason[0] = '\0';
+
+	snap->snake_len = game->snake_len;
+	snap->snake_dir = game->snake_dir;
+	snap->snake_step_remain = game->snake_step_remain;
+	snap->head = SNAKE_GAME_BODY(game, 0);
+	snap->pt = game->pt;
+	snake_rng_copy(&snap->rng, &game->cold->rng);
+	memcpy(snap->dist_to_hit, game->dist_to_hit, sizeof(snap->dist_to_hit));
+	memcpy(snap->dist_to_food, game->dist_to_food, sizeof(snap->dist_to_food));
+
+	/* Segments grown by eating stay at (-1, -1) until the snake moves */
+	snap->n_tail_pending = 0;
+	for (i = game->snake_len - 1; i > 0; i--)
+	{
+		body = &SNAKE_GAME_BODY(game, i);
+		if (body->x != -1 || body->y != -1)
+			break;
+		snap->n_tail_pending++;
+	}
+
+	/* Pack the step from every placed segment to the next one */
+	n_step = game->snake_len - snap->n_tail_pending - 1;
+	if (n_step > snap->body_cap)
+	{
+		while (snap->body_cap < n_step)
+			snap->body_cap *= 2;
+		free(snap->body);
+		snap->body = malloc(snap->body_cap / 4);
+	}
+	for (i = 0; i < n_step; i++)
+	{
+		if ((i & 3) == 0)
+			snap->body[i >> 2] = 0;
+		snap->body[i >> 2] |= _point_get_direction(&SNAKE_GAME_BODY(game, i), &SNAKE_GAME_BODY(game, i + 1)) << ((i & 3) * 2);
+	}
+
+	if (!game->free_index)
+	{
+		snap->n_free = -1;
+		snap->stamp = 0;
+		snap->prev_stamp = 0;
+		return 0;
+	}
+
+	/* The game moved on from the last snapshot into snap, only the slots it changed are copied */
+	stamp = atomic_fetch_add(&snapshot_stamp, 1) + 1;
+	if (game->free_stamp != 0 && game->free_stamp == snap->stamp)
+	{
+		_snapshot_reserve_delta(snap, game->n_free_dirty);
+		for (i = 0; i < game->n_free_dirty; i++)
+		{
+			snap->free_cells[game->free_dirty[i]] = game->free_cells[game->free_dirty[i]];
+			snap->free_delta[i] = game->free_dirty[i];
+		}
+		snap->n_free_delta = game->n_free_dirty;
+		snap->prev_stamp = snap->stamp;
+	}
+	else
+	{
+		if (snap->free_cells == NULL)
+			snap->free_cells = malloc(sizeof(int) * game->size_x * game->size_y);
+		memcpy(snap->free_cells, game->free_cells, sizeof(int) * game->size_x * game->size_y);
+		snap->n_free_delta = 0;
+		snap->prev_stamp = 0;
+	}
+	snap->n_free = game->n_free;
+	snap->stamp = stamp;
+
+	game->free_stamp = stamp;
+	game->n_free_dirty = 0;
+
+	return 0;
+}
+
+int
+snake_game_restore(SnakeGame *game, const SnakeGameSnapshot *snap)
+{
+	int i;
+	int n_step;
+	int n_cell;
+	int cell;
+	Point *body;
+
+	if (game->size_x != snap->size_x || game->size_y != snap->size_y)
+		return -1;
+	if (game->food_mode != snap->food_mode || game->cold->rng.type != snap->rng.type)
+		return -1;
+
+	game->max_step = snap->max_step;
+	game->init_step_to_food = snap->init_step_to_food;
+	game->total_step_to_food = snap->total_step_to_food;
+	game->total_step_used = snap->total_step_used;
+	game->game_over = snap->game_over;
+	if (snap->game_over)
+		memcpy(game->cold->game_over_reason, snap->game_over_reason, sizeof(game->cold->game_over_reason));
+	else
+		game->cold->game_over_reason[0] = '\0';
+
+	game->snake_dir = snap->snake_dir;
+	game->snake_step_remain = snap->snake_step_remain;
+	game->pt = snap->pt;
+	memcpy(game->dist_to_hit, snap->dist_to_hit, sizeof(game->dist_to_hit));
+	memcpy(game->dist_to_food, snap->dist_to_food, sizeof(game->dist_to_food));
+
+	/* Unpack the body from the head at slot 0 */
+	_snake_reserve(game, snap->snake_len);
+	game->snake_head = 0;
+	game->snake_len = snap->snake_len;
+	body = game->snake_body;
+	body[0] = snap->head;
+	n_step = snap->snake_len - snap->n_tail_pending - 1;
+	for (i = 0; i < n_step; i++)
+	{
+		body[i + 1] = body[i];
+		_point_move(&body[i + 1], (snap->body[i >> 2] >> ((i & 3) * 2)) & 3);
+	}
+	for (i = n_step + 1; i < snap->snake_len; i++)
+	{
+		body[i].x = -1;
+		body[i].y = -1;
+	}
+
+	/* Count the cells under the body again, the head may be on the body if it hit itself */
+	cell_map_clear(&game->snake_cells);
+	if (game->loop)
+	{
+		game->loop->body_hash = 0;
+		_loop_restart(game);
+	}
+	for (i = 0; i <= n_step; i++)
+	{
+		cell = _game_get_cell(game, &body[i]);
+		if (cell < 0)
+			continue;
+		cell_map_add(&game->snake_cells, cell);
+		if (game->loop)
+			game->loop->body_hash ^= _loop_key(cell);
+	}
+	cell = _game_get_cell(game, &body[0]);
+	game->snake_hit_itself = cell >= 0 && cell_map_get(&game->snake_cells, cell) > 1;
+
+	if (game->obs)
+	{
+		snake_obs_clear(game->obs);
+		for (i = 0; i <= n_step; i++)
+			snake_obs_set(game->obs, body[i].x, body[i].y);
+	}
+
+	n_cell = game->size_x * game->size_y;
+	if (snap->n_free >= 0)
+	{
+		if (game->free_cells == NULL)
+		{
+			game->free_cells = malloc(sizeof(int) * n_cell);
+			game->free_pos = malloc(sizeof(int) * n_cell);
+		}
+
+		/*
+		 * A game last restored from this snapshot, or from its previous content,
+		 * differs from it only in the slots it changed since and the ones the snapshot changed
+		 */
+		if (game->free_index && game->free_stamp != 0 && game->free_stamp == snap->stamp)
+		{
+			_game_free_cells_sync(game, snap->free_cells, game->free_dirty, game->n_free_dirty);
+		}
+		else if (game->free_index && game->free_stamp != 0 && game->free_stamp == snap->prev_stamp)
+		{
+			_game_free_cells_sync(game, snap->free_cells, game->free_dirty, game->n_free_dirty);
+			_game_free_cells_sync(game, snap->free_cells, snap->free_delta, snap->n_free_delta);
+		}
+		else
+		{
+			memcpy(game->free_cells, snap->free_cells, sizeof(int) * n_cell);
+			for (i = 0; i < n_cell; i++)
+				game->free_pos[game->free_cells[i]] = i;
+		}
+		game->free_index = 1;
+		game->n_free = snap->n_free;
+		game->free_stamp = snap->stamp;
+		game->n_free_dirty = 0;
+	}
+	else
+	{
+		/* The snapshot was taken before the index was built */
+		game->free_index = 0;
+		game->n_free = 0;
+		game->free_stamp = 0;
+		game->n_free_dirty = 0;
+	}
+
+	/* The generator goes on from where the game was */
+	snake_rng_copy(&game->cold->rng, &snap->rng);
+
+	return 0;
+}
@@ -1,8 +1,11 @@
 #ifndef __SNAKE_GAME_H
 #define __SNAKE_GAME_H
 
+#include <stdint.h>
 #include <sys/time.h>
-#include "mtwister.h"
+#include "snake_rng.h"
+#include "snake_obs.h"
+#include "cell_map.h"
 
 /***************************** Game Configuration *****************************/
 
@@ -13,6 +16,13 @@
 		)
 #endif
 
+/* Largest field on each side */
+#define SNAKE_GAME_MAX_SIZE	4096
+
+/* The i-th segment of the snake, 0 is the head */
+#define SNAKE_GAME_BODY(game, i)	\
+		((game)->snake_body[((game)->snake_head + (i)) & ((game)->snake_body_cap - 1)])
+
 typedef struct {
 	int x;
 	int y;
@@ -26,42 +36,170 @@ typedef enum {
 	DIRECTION_NONE,
 } DIRECTION;
 
+typedef enum {
+	FOOD_MODE_FREE_CELL,	/* Pick uniformly from the free cells with one draw */
+	FOOD_MODE_LEGACY,		/* One random cell, reproduces games of old seeds */
+} FOOD_MODE;
+
 typedef struct {
-	/* Game info */
-	struct timeval tv_last_step;
+	int size_x;
+	int size_y;
 	int step_per_sec;
-	int init_step_to_food;
-	int total_step_to_food;
-	int total_step_used;
 	int max_step;
-	int game_over;
+	FOOD_MODE food_mode;
+	OBS_ENCODER obs_encoder;	/* What snake_game_get_observation writes */
+	int obs_vision_size;		/* k of OBS_ENCODER_VISION */
+	SNAKE_RNG rng;				/* Generator behind the seed */
+	/*
+	 * End a game as hunger once a state comes back without a meal in between.
+	 * Only for players which always make the same move in the same state, they would circle until they starve.
+	 */
+	int detect_loop;
+} SnakeGameConfig;
+
+/* State a game only touches when it is created, shown, timed, over or placing food */
+typedef struct {
+	struct timeval tv_last_step;
+	int step_per_sec;
 	char game_over_reason[64];
-	int size_x;
-	int size_y;
 
+	/* Display, only allocated once the game is shown */
+	char *display_bg;	/* Background buffer before showing in terminal */
+	char *display_fg;	/* Foreground buffer after showing in terminal */
+
+	SnakeRng rng;
+} SnakeGameCold;
+
+/*
+ * Loop detection between two meals, Brent's algorithm on the game state.
+ * A state is the body and the direction, food and the random generator only change when the snake eats.
+ * States are compared by hash first and then exactly.
+ */
+typedef struct {
+	uint64_t body_hash;		/* Of the cells under the snake, kept up to date by every move */
+	uint64_t saved_hash;
+	Point *saved_body;		/* The state the current one is compared with */
+	int saved_cap;
+	int saved_len;			/* 0 if no state is saved */
+	DIRECTION saved_dir;
+	int power;				/* The saved state moves up every power steps, power doubles every time */
+	int lam;				/* Steps since the state was saved */
+} SnakeGameLoop;
+
+/*
+ * The game is laid out by how often a step touches a field,
+ * the first cache line is read by every step, the second by most of them,
+ * the rest only when the snake eats and the cold part behind a pointer.
+ */
+typedef struct {
 	/* Snake */
-	Point *snake_body;
+	Point *snake_body;		/* Ring buffer from the head to the tail, use SNAKE_GAME_BODY */
+	int snake_body_cap;		/* Slots of snake_body, a power of 2 which grows with the snake */
+	int snake_head;			/* Slot of the head */
 	int snake_len;			/* Length of snake */
 	DIRECTION snake_dir;	/* Direction for snake to move */
 	int snake_step_remain;	/* How many steps remain before snake die because it didn't eat */
+	int snake_hit_itself;	/* The head moved onto the body */
 
 	/* Point */
 	Point pt;
 
-	/* Display */
-	char *display_bg;	/* Background buffer before showing in terminal */
-	char *display_fg;	/* Foreground buffer after showing in terminal */
-	MTRand mtrand;
+	int size_x;
+	int size_y;
+	int game_over;
+	int free_index;		/* The free cell index is built, the arrays are kept across resets once allocated */
+	SnakeObs *obs;		/* Fields of an extended encoder, NULL for OBS_ENCODER_BASIC */
+
+	CellMap snake_cells;	/* Cells under the snake, with how many segments are on each */
 
 	/* Feed to neural network */
 	int dist_to_hit[4];
 	int dist_to_food[4];
+
+	/*
+	 * Free cell index of FOOD_MODE_FREE_CELL, the first n_free of free_cells are not covered by the snake.
+	 * free_pos is where a cell is in free_cells.
+	 * It covers the whole field, so it is only built once the snake covers half of it,
+	 * before that food is redrawn from the whole field until it lands on a free cell.
+	 */
+	int *free_cells;
+	int *free_pos;
+	int n_free;
+	/*
+	 * Slots of free_cells changed since the index was the content free_stamp of a snapshot,
+	 * so a snapshot or restore between the two only copies those. A free_stamp of 0 matches no snapshot.
+	 */
+	int *free_dirty;
+	int n_free_dirty;
+	int free_dirty_cap;
+	unsigned long free_stamp;
+
+	/* Game info */
+	FOOD_MODE food_mode;
+	int init_step_to_food;
+	int total_step_to_food;
+	int total_step_used;
+	int max_step;
+	int n_observation;
+
+	SnakeGameCold *cold;
+	SnakeGameLoop *loop;	/* NULL unless config->detect_loop */
 } SnakeGame;
 
-SnakeGame *snake_game_create(int x, int y, int step_per_sec, int max_step, int seed);
+/*
+ * A compact copy of the game state.
+ * The body is packed as 2-bit steps from the head to the tail,
+ * the random generator is copied as it is, MT ones only keep their place in the stream of the seed.
+ * Cold data (display, timestamp) is not part of it.
+ * Memory grows with the snake, the free cell index is only held once a game has one.
+ */
+typedef struct {
+	int size_x;
+	int size_y;
+	int max_step;
+	int init_step_to_food;
+	int total_step_to_food;
+	int total_step_used;
+	int game_over;
+	char game_over_reason[64];
+
+	int snake_len;
+	DIRECTION snake_dir;
+	int snake_step_remain;
+	Point head;
+	int n_tail_pending;		/* Grown tail segments which are not placed yet */
+
+	Point pt;
+	SnakeRng rng;
+
+	int dist_to_hit[4];
+	int dist_to_food[4];
+
+	int body_cap;			/* How many steps body can hold */
+	unsigned char *body;	/* 4 steps per byte */
+
+	/* Order of the free cell index, food placement depends on it */
+	FOOD_MODE food_mode;
+	int n_free;				/* -1 if the game has no index yet */
+	int *free_cells;		/* NULL until a game with an index is taken */
+	/*
+	 * Every snapshot of an index gets a new stamp,
+	 * free_delta lists the slots which changed from the content of prev_stamp to the one of stamp, 0 if unknown.
+	 */
+	unsigned long stamp;
+	unsigned long prev_stamp;
+	int *free_delta;
+	int n_free_delta;
+	int free_delta_cap;
+} SnakeGameSnapshot;
+
+SnakeGame *snake_game_create(const SnakeGameConfig *config, int seed);
 
 void snake_game_free(SnakeGame *game);
 
+/* Start a new game with the seed, reusing the memory of the game */
+void snake_game_reset(SnakeGame *game, int seed);
+
 void snake_game_set_direction(SnakeGame *game, DIRECTION dir, int prevent_suicide);
 
 void snake_game_update(SnakeGame *game, int no_wait, int update_display);
@@ -78,4 +216,16 @@ const char *snake_game_get_game_over_reason(SnakeGame *game);
 
 float snake_game_get_performance(SnakeGame *game);
 
+int snake_game_get_n_observation(const SnakeGameConfig *config);
+
+void snake_game_get_observation(SnakeGame *game, float *obs);
+
+SnakeGameSnapshot *snake_game_snapshot_create(const SnakeGameConfig *config);
+
+void snake_game_snapshot_free(SnakeGameSnapshot *snap);
+
+int snake_game_snapshot(SnakeGame *game, SnakeGameSnapshot *snap);
+
+int snake_game_restore(SnakeGame *game, const SnakeGameSnapshot *snap);
+
 #endif /* __SNAKE_GAME_H */
@@ -0,0 +1,276 @@
+#include "snake_island.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+
+/* "SNKI", starts every island file */
+#define ISLAND_FILE_MAGIC	0x494b4e53
+#define ISLAND_FILE_VERSION	2
+#define ISLAND_FILE_SUFFIX	".island"
+
+static char *_island_path(SnakeIsland *island, const char *file_name, const char *suffix);
+static SnakeIslandPeer *_island_get_peer(SnakeIsland *island, const char *name);
+static int _island_is_known(NNEliteList *list, NeuralNetwork *nn);
+static int _island_import_file(SnakeIsland *island, const char *file_name, NNEliteList *list, int n_input, int n_output);
+
+static char *
+_island_path(SnakeIsland *island, const char *file_name, const char *suffix)
+{
+	char *path;
+	int len;
+
+	len = strlen(island->dir) + 1 + strlen(file_name) + strlen(suffix) + 1;
+	path = malloc(len);
+	snprintf(path, len, "%s/%s%s", island->dir, file_name, suffix);
+	return path;
+}
+
+static SnakeIslandPeer *
+_island_get_peer(SnakeIsland *island, const char *name)
+{
+	int i;
+
+	for (i = 0; i < island->n_peer; i++)
+	{
+		if (strcmp(island->peers[i].name, name) == 0)
+			return &island->peers[i];
+	}
+
+	if (island->n_peer == island->peer_cap)
+	{
+		island->peer_cap = island->peer_cap ? island->peer_cap * 2 : 8;
+		island->peers = realloc(island->peers, sizeof(SnakeIslandPeer) * island->peer_cap);
+	}
+
+	snprintf(island->peers[island->n_peer].name, SNAKE_ISLAND_NAME_LEN, "%s", name);
+	island->peers[island->n_peer].nonce = 0;
+	island->peers[island->n_peer].seq = 0;
+	return &island->peers[island->n_peer++];
+}
+
+static int
+_island_is_known(NNEliteList *list, NeuralNetwork *nn)
+{
+	NeuralNetwork *el;
+	int i;
+
+	/* Our own elites come back once another island has passed them on */
+	for (i = 0; (el = nn_elites_get_nth(list, i, NULL)) != NULL; i++)
+	{
+		if (el->_n_weight != nn->_n_weight || el->use_bias != nn->use_bias)
+			continue;
+		if (memcmp(el->weight, nn->weight, sizeof(float) * nn->_n_weight))
+			continue;
+		if (nn->use_bias && memcmp(el->bias, nn->bias, sizeof(float) * nn->_n_neuro))
+			continue;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+_island_import_file(SnakeIsland *island, const char *file_name, NNEliteList *list, int n_input, int n_output)
+{
+	FILE *f;
+	char *path;
+	char name[SNAKE_ISLAND_NAME_LEN];
+	SnakeIslandPeer *peer;
+	NeuralNetwork *nn;
+	float goodness;
+	int header[5];
+	int len;
+	int n_added;
+	int i;
+
+	/* <name>.island of another island */
+	len = strlen(file_name) - strlen(ISLAND_FILE_SUFFIX);
+	if (len <= 0 || len >= SNAKE_ISLAND_NAME_LEN || strcmp(file_name + len, ISLAND_FILE_SUFFIX))
+		return 0;
+	memcpy(name, file_name, len);
+	name[len] = '\0';
+	if (strcmp(name, island->name) == 0)
+		return 0;
+
+	path = _island_path(island, file_name, "");
+	f = fopen(path, "rb");
+	free(path);
+	if (f == NULL)
+		return 0;
+
+	n_added = 0;
+	/* magic, version, nonce, seq, number of elites */
+	if (fread(header, sizeof(header[0]), 5, f) != 5)
+		goto __exit;
+	if (header[0] != ISLAND_FILE_MAGIC || header[1] != ISLAND_FILE_VERSION)
+		goto __exit;
+
+	/* A restarted island counts from 0 again */
+	peer = _island_get_peer(island, name);
+	if ((unsigned int)header[2] != peer->nonce)
+	{
+		peer->nonce = header[2];
+		peer->seq = 0;
+	}
+	if (header[3] <= peer->seq)
+		goto __exit;	/* Already taken */
+	peer->seq = header[3];
+
+	for (i = 0; i < header[4]; i++)
+	{
+		nn = nn_loadf(f);
+		if (nn == NULL)
+			break;
+		if (fread(&goodness, sizeof(goodness), 1, f) != 1)
+		{
+			nn_free(nn);
+			break;
+		}
+
+		/* Only networks which see and act like ours can live here */
+		if (nn->n_input != n_input || nn->n_output != n_output || _island_is_known(list, nn))
+		{
+			nn_free(nn);
+			continue;
+		}
+
+		nn_elites_add(list, nn, goodness);
+		n_added++;
+	}
+
+__exit:
+	fclose(f);
+	return n_added;
+}
+
+SnakeIsland *
+snake_island_create(const char *dir, const char *name, int n_migrant)
+{
+	SnakeIsland *island;
+
+	/* The name is a file name in dir */
+	if (name[0] == '\0' || strchr(name, '/') || strlen(name) >= SNAKE_ISLAND_NAME_LEN)
+		return NULL;
+	if (n_migrant < 1)
+		return NULL;
+
+	island = malloc(sizeof(*island));
+	island->dir = strdup(dir);
+	strcpy(island->name, name);
+	island->n_migrant = n_migrant;
+	island->nonce = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16) ^ (unsigned int)clock();
+	island->seq = 0;
+	island->peers = NULL;
+	island->n_peer = 0;
+	island->peer_cap = 0;
+
+	return island;
+}
+
+void
+snake_island_free(SnakeIsland *island)
+{
+	free(island->dir);
+	free(island->peers);
+	free(island);
+}
+
+int
+snake_island_export(SnakeIsland *island, NNEliteList *list)
+{
+	FILE *f;
+	char *tmp_path;
+	char *path;
+	float goodness;
+	int header[5];
+	int ret;
+	int i;
+
+	header[0] = ISLAND_FILE_MAGIC;
+	header[1] = ISLAND_FILE_VERSION;
+	header[2] = island->nonce;
+	header[3] = island->seq + 1;
+	header[4] = nn_elites_get_count(list);
+	if (header[4] > island->n_migrant)
+		header[4] = island->n_migrant;
+
+	/* Write aside and rename, so other islands never read half a file */
+	tmp_path = _island_path(island, island->name, ISLAND_FILE_SUFFIX ".tmp");
+	path = _island_path(island, island->name, ISLAND_FILE_SUFFIX);
+	ret = -1;
+
+	f = fopen(tmp_path, "wb");
+	if (f == NULL)
+		goto __exit;
+
+	if (fwrite(header, sizeof(header[0]), 5, f) != 5)
+		goto __close;
+	for (i = 0; i < header[4]; i++)
+	{
+		if (nn_savef(nn_elites_get_nth(list, i, &goodness), f))
+			goto __close;
+		if (fwrite(&goodness, sizeof(goodness), 1, f) != 1)
+			goto __close;
+	}
+	ret = 0;
+
+__close:
+	if (fclose(f))
+		ret = -1;
+	if (ret == 0 && rename(tmp_path, path))
+		ret = -1;
+	if (ret == 0)
+		island->seq++;
+__exit:
+	free(tmp_path);
+	free(path);
+	return ret;
+}
+
+int
+snake_island_import(SnakeIsland *island, NNEliteList *list, int n_input, int n_output)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int n_added;
+
+	dir = opendir(island->dir);
+	if (dir == NULL)
+		return -1;
+
+	/* Returns how many elites came in */
+	n_added = 0;
+	while ((ent = readdir(dir)) != NULL)
+		n_added += _island_import_file(island, ent->d_name, list, n_input, n_output);
+
+	closedir(dir);
+	return n_added;
+}
+
+/* Hand the migrants to list unless list has them already, migrants is left empty */
+int
+snake_island_merge(NNEliteList *list, NNEliteList *migrants)
+{
+	NeuralNetwork *nn;
+	float goodness;
+	int n_added;
+
+	n_added = 0;
+	while ((nn = nn_elites_pop(migrants, &goodness)) != NULL)
+	{
+		if (_island_is_known(list, nn))
+		{
+			nn_free(nn);
+			continue;
+		}
+
+		nn_elites_add(list, nn, goodness);
+		n_added++;
+	}
+
+	return n_added;
+}
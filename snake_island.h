@@ -0,0 +1,43 @@
+#ifndef __SNAKE_ISLAND_H
+#define __SNAKE_ISLAND_H
+
+#include "neural_network_elite.h"
+
+/* Length of an island name */
+#define SNAKE_ISLAND_NAME_LEN	64
+
+/* Last migration seen from another island, so it is only taken once */
+typedef struct {
+	char name[SNAKE_ISLAND_NAME_LEN];
+	unsigned int nonce;		/* Run of the island the seq counts in */
+	int seq;
+} SnakeIslandPeer;
+
+/*
+ * One trainer process of an island model.
+ * Islands share a directory, every island publishes its best elites there as <name>.island
+ * and takes the ones the other islands published.
+ */
+typedef struct {
+	char *dir;
+	char name[SNAKE_ISLAND_NAME_LEN];
+	int n_migrant;			/* Elites published per migration */
+	unsigned int nonce;		/* Tells this run from an earlier run of the same name */
+	int seq;				/* Migrations published so far */
+
+	SnakeIslandPeer *peers;
+	int n_peer;
+	int peer_cap;
+} SnakeIsland;
+
+SnakeIsland *snake_island_create(const char *dir, const char *name, int n_migrant);
+
+void snake_island_free(SnakeIsland *island);
+
+int snake_island_export(SnakeIsland *island, NNEliteList *list);
+
+int snake_island_import(SnakeIsland *island, NNEliteList *list, int n_input, int n_output);
+
+int snake_island_merge(NNEliteList *list, NNEliteList *migrants);
+
+#endif /* __SNAKE_ISLAND_H */
@@ -0,0 +1,159 @@
+#include "snake_lookahead.h"
+#include "snake_eval.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int _direction_is_reverse(DIRECTION a, DIRECTION b);
+
+static int
+_direction_is_reverse(DIRECTION a, DIRECTION b)
+{
+	switch (a)
+	{
+		case DIRECTION_UP:
+			return b == DIRECTION_DOWN;
+		case DIRECTION_DOWN:
+			return b == DIRECTION_UP;
+		case DIRECTION_LEFT:
+			return b == DIRECTION_RIGHT;
+		case DIRECTION_RIGHT:
+			return b == DIRECTION_LEFT;
+		default:
+			break;
+	}
+	return 0;
+}
+
+SnakeLookahead *
+snake_lookahead_create(const SnakeGameConfig *config, int horizon)
+{
+	SnakeLookahead *la;
+	int i;
+
+	if (horizon < 1)
+		return NULL;
+
+	la = malloc(sizeof(*la));
+	la->horizon = horizon;
+	la->root = snake_game_snapshot_create(config);
+	la->n_observation = snake_game_get_n_observation(config);
+	la->observation = malloc(sizeof(float) * 4 * la->n_observation);
+	/* The seed does not matter, every rollout gets restored before it runs */
+	for (i = 0; i < 4; i++)
+		la->rollout[i] = snake_game_create(config, 0);
+
+	return la;
+}
+
+void
+snake_lookahead_free(SnakeLookahead *la)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		snake_game_free(la->rollout[i]);
+	snake_game_snapshot_free(la->root);
+	free(la->observation);
+	free(la);
+}
+
+DIRECTION
+snake_lookahead_choose(SnakeLookahead *la, NeuralNetwork *nn, SnakeGame *game)
+{
+	int d;
+	int a;
+	int i;
+	int step;
+	int n_active;
+	int score;
+	int value[4];
+	int survived[4];
+	float *output;
+	DIRECTION best;
+
+	/* The network's own choice wins every tie */
+	snake_game_get_observation(game, la->observation);
+	output = nn_run(nn, la->observation);
+	best = snake_eval_argmax(output, nn->n_output);
+
+	if (snake_game_snapshot(game, la->root))
+		return best;
+	score = snake_game_get_score(game);
+
+	/*
+	 * 1. Take every candidate move on its own copy of the game.
+	 * Turning back is ignored by the game, so it is not a candidate.
+	 */
+	n_active = 0;
+	for (d = 0; d < 4; d++)
+	{
+		survived[d] = -1;
+		if (_direction_is_reverse(game->snake_dir, d))
+			continue;
+
+		snake_game_restore(la->rollout[d], la->root);
+		snake_game_set_direction(la->rollout[d], d, 1);
+		snake_game_update(la->rollout[d], 1, 0);
+		survived[d] = 0;
+		if (!snake_game_is_over(la->rollout[d]))
+		{
+			survived[d]++;
+			la->active[n_active++] = d;
+		}
+	}
+
+	/*
+	 * 2. Let the network play on every rollout in lockstep
+	 */
+	for (step = 1; step < la->horizon && n_active > 0; step++)
+	{
+		for (a = 0; a < n_active; a++)
+		{
+			snake_game_get_observation(la->rollout[la->active[a]],
+					&la->observation[a * la->n_observation]);
+		}
+
+		output = nn_run_batch(nn, la->observation, n_active);
+
+		i = 0;
+		for (a = 0; a < n_active; a++)
+		{
+			d = la->active[a];
+			snake_game_set_direction(la->rollout[d],
+					snake_eval_argmax(&output[a * nn->n_output], nn->n_output),
+					1);
+			snake_game_update(la->rollout[d], 1, 0);
+
+			if (!snake_game_is_over(la->rollout[d]))
+			{
+				survived[d]++;
+				la->active[i++] = d;
+			}
+		}
+		n_active = i;
+	}
+
+	/*
+	 * 3. Food eaten counts first, then how long the snake stays alive
+	 */
+	for (d = 0; d < 4; d++)
+	{
+		if (survived[d] < 0)
+		{
+			value[d] = -1;
+			continue;
+		}
+		value[d] = (snake_game_get_score(la->rollout[d]) - score) * (la->horizon + 1) + survived[d];
+	}
+
+	if (_direction_is_reverse(game->snake_dir, best))
+		best = game->snake_dir;
+	for (d = 0; d < 4; d++)
+	{
+		if (value[d] > value[best])
+			best = d;
+	}
+
+	return best;
+}
@@ -0,0 +1,28 @@
+#ifndef __SNAKE_LOOKAHEAD_H
+#define __SNAKE_LOOKAHEAD_H
+
+#include "snake_game.h"
+#include "neural_network.h"
+
+/*
+ * Lookahead player.
+ * Before committing a move, every candidate move is tried on a restored copy of the game
+ * and played on by the network for a few steps.
+ * The rollouts of all candidates are stepped together with one batched forward pass.
+ */
+typedef struct {
+	int horizon;		/* How many steps a rollout lasts */
+	SnakeGameSnapshot *root;
+	SnakeGame *rollout[4];	/* One rollout per direction */
+	int active[4];
+	int n_observation;
+	float *observation;		/* 4 x n_observation */
+} SnakeLookahead;
+
+SnakeLookahead *snake_lookahead_create(const SnakeGameConfig *config, int horizon);
+
+void snake_lookahead_free(SnakeLookahead *la);
+
+DIRECTION snake_lookahead_choose(SnakeLookahead *la, NeuralNetwork *nn, SnakeGame *game);
+
+#endif /* __SNAKE_LOOKAHEAD_H */
@@ -0,0 +1,329 @@
+#include "snake_obs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef ABS
+#define ABS(x)	((x) < 0 ? -(x) : (x))
+#endif
+#ifndef MIN
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#endif
+
+/* Values per ray: distance to wall, to body and to food */
+#define RAY_N_VALUE	3
+#define RAY_N		8
+
+/* UP, DOWN, LEFT, RIGHT like DIRECTION, then the diagonals */
+static const int ray_dx[RAY_N] = { 0, 0, -1, 1, -1, 1, -1, 1 };
+static const int ray_dy[RAY_N] = { -1, 1, 0, 0, -1, -1, 1, 1 };
+
+static void _bits_set(uint64_t *bits, int i);
+static void _bits_clear(uint64_t *bits, int i);
+static int _bits_test(uint64_t *bits, int i);
+static int _bits_next(uint64_t *bits, int n_word, int from);
+static int _bits_prev(uint64_t *bits, int from);
+
+static int _obs_ray_to_body(SnakeObs *obs, int ray, int x, int y);
+static void _obs_encode_rays(SnakeObs *obs, int head_x, int head_y, int food_x, int food_y, float *out);
+static void _obs_encode_vision(SnakeObs *obs, int head_x, int head_y, int food_x, int food_y, float *out);
+
+static void
+_bits_set(uint64_t *bits, int i)
+{
+	bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static void
+_bits_clear(uint64_t *bits, int i)
+{
+	bits[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+static int
+_bits_test(uint64_t *bits, int i)
+{
+	return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static int
+_bits_next(uint64_t *bits, int n_word, int from)
+{
+	int w;
+	uint64_t word;
+
+	/* The first set bit at from or after it, -1 if none */
+	w = from >> 6;
+	if (w >= n_word)
+		return -1;
+
+	word = bits[w] & (~(uint64_t)0 << (from & 63));
+	while (word == 0)
+	{
+		if (++w >= n_word)
+			return -1;
+		word = bits[w];
+	}
+
+	return (w << 6) + __builtin_ctzll(word);
+}
+
+static int
+_bits_prev(uint64_t *bits, int from)
+{
+	int w;
+	uint64_t word;
+
+	/* The last set bit at from or before it, -1 if none */
+	if (from < 0)
+		return -1;
+
+	w = from >> 6;
+	word = bits[w] & (~(uint64_t)0 >> (63 - (from & 63)));
+	while (word == 0)
+	{
+		if (--w < 0)
+			return -1;
+		word = bits[w];
+	}
+
+	return (w << 6) + 63 - __builtin_clzll(word);
+}
+
+static int
+_obs_ray_to_body(SnakeObs *obs, int ray, int x, int y)
+{
+	int i;
+	uint64_t *bits;
+
+	/* Steps to the first body cell along the ray, 0 if there is none */
+	switch (ray)
+	{
+		case 0:	/* UP */
+			i = _bits_prev(&obs->col_bits[x * obs->n_word_y], y - 1);
+			return i < 0 ? 0 : y - i;
+
+		case 1:	/* DOWN */
+			i = _bits_next(&obs->col_bits[x * obs->n_word_y], obs->n_word_y, y + 1);
+			return i < 0 ? 0 : i - y;
+
+		case 2:	/* LEFT */
+			i = _bits_prev(&obs->row_bits[y * obs->n_word_x], x - 1);
+			return i < 0 ? 0 : x - i;
+
+		case 3:	/* RIGHT */
+			i = _bits_next(&obs->row_bits[y * obs->n_word_x], obs->n_word_x, x + 1);
+			return i < 0 ? 0 : i - x;
+
+		case 4:	/* UP LEFT */
+			bits = &obs->diag_bits[(x - y + obs->size_y - 1) * obs->n_word_x];
+			i = _bits_prev(bits, x - 1);
+			return i < 0 ? 0 : x - i;
+
+		case 5:	/* UP RIGHT */
+			bits = &obs->anti_bits[(x + y) * obs->n_word_x];
+			i = _bits_next(bits, obs->n_word_x, x + 1);
+			return i < 0 ? 0 : i - x;
+
+		case 6:	/* DOWN LEFT */
+			bits = &obs->anti_bits[(x + y) * obs->n_word_x];
+			i = _bits_prev(bits, x - 1);
+			return i < 0 ? 0 : x - i;
+
+		case 7:	/* DOWN RIGHT */
+			bits = &obs->diag_bits[(x - y + obs->size_y - 1) * obs->n_word_x];
+			i = _bits_next(bits, obs->n_word_x, x + 1);
+			return i < 0 ? 0 : i - x;
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+static void
+_obs_encode_rays(SnakeObs *obs, int head_x, int head_y, int food_x, int food_y, float *out)
+{
+	int r;
+	int k;
+	int to_wall_x;
+	int to_wall_y;
+	int food_dx;
+	int food_dy;
+
+	food_dx = food_x - head_x;
+	food_dy = food_y - head_y;
+	for (r = 0; r < RAY_N; r++)
+	{
+		/* Steps until the ray leaves the field */
+		to_wall_x = ray_dx[r] < 0 ? head_x + 1 : obs->size_x - head_x;
+		to_wall_y = ray_dy[r] < 0 ? head_y + 1 : obs->size_y - head_y;
+		if (ray_dx[r] == 0)
+			out[0] = to_wall_y;
+		else if (ray_dy[r] == 0)
+			out[0] = to_wall_x;
+		else
+			out[0] = MIN(to_wall_x, to_wall_y);
+
+		out[1] = _obs_ray_to_body(obs, r, head_x, head_y);
+
+		/* The food is on the ray if it is k steps of (dx, dy) away */
+		k = MAX(ABS(food_dx), ABS(food_dy));
+		if (k > 0 && food_dx == ray_dx[r] * k && food_dy == ray_dy[r] * k)
+			out[2] = k;
+		else
+			out[2] = 0;
+
+		out += RAY_N_VALUE;
+	}
+}
+
+static void
+_obs_encode_vision(SnakeObs *obs, int head_x, int head_y, int food_x, int food_y, float *out)
+{
+	int r;
+	int x;
+	int y;
+
+	r = obs->vision_size / 2;
+	for (y = head_y - r; y <= head_y + r; y++)
+	{
+		for (x = head_x - r; x <= head_x + r; x++)
+		{
+			if (x < 0 || x >= obs->size_x || y < 0 || y >= obs->size_y)
+				*out = SNAKE_OBS_CELL_WALL;
+			else if (x == food_x && y == food_y)
+				*out = SNAKE_OBS_CELL_FOOD;
+			else if (_bits_test(&obs->row_bits[y * obs->n_word_x], x))
+				*out = SNAKE_OBS_CELL_BODY;
+			else
+				*out = SNAKE_OBS_CELL_EMPTY;
+			out++;
+		}
+	}
+}
+
+int
+snake_obs_get_n(OBS_ENCODER encoder, int vision_size)
+{
+	switch (encoder)
+	{
+		case OBS_ENCODER_RAYS:
+			return SNAKE_OBS_N_BASIC + RAY_N * RAY_N_VALUE;
+
+		case OBS_ENCODER_VISION:
+			return SNAKE_OBS_N_BASIC + vision_size * vision_size;
+
+		default:
+			break;
+	}
+	return SNAKE_OBS_N_BASIC;
+}
+
+SnakeObs *
+snake_obs_create(OBS_ENCODER encoder, int vision_size, int size_x, int size_y)
+{
+	SnakeObs *obs;
+	int n_diag;
+
+	if (encoder == OBS_ENCODER_BASIC)
+		return NULL;
+	if (encoder == OBS_ENCODER_VISION && (vision_size < 1 || (vision_size & 1) == 0))
+		return NULL;
+
+	obs = malloc(sizeof(*obs));
+	obs->encoder = encoder;
+	obs->vision_size = vision_size;
+	obs->size_x = size_x;
+	obs->size_y = size_y;
+	obs->n_word_x = (size_x + 63) / 64;
+	obs->n_word_y = (size_y + 63) / 64;
+
+	n_diag = size_x + size_y - 1;
+	obs->row_bits = malloc(sizeof(uint64_t) * size_y * obs->n_word_x);
+	obs->col_bits = malloc(sizeof(uint64_t) * size_x * obs->n_word_y);
+	obs->diag_bits = malloc(sizeof(uint64_t) * n_diag * obs->n_word_x);
+	obs->anti_bits = malloc(sizeof(uint64_t) * n_diag * obs->n_word_x);
+	snake_obs_clear(obs);
+
+	return obs;
+}
+
+void
+snake_obs_free(SnakeObs *obs)
+{
+	free(obs->row_bits);
+	free(obs->col_bits);
+	free(obs->diag_bits);
+	free(obs->anti_bits);
+	free(obs);
+}
+
+void
+snake_obs_clear(SnakeObs *obs)
+{
+	int n_diag;
+
+	n_diag = obs->size_x + obs->size_y - 1;
+	memset(obs->row_bits, 0, sizeof(uint64_t) * obs->size_y * obs->n_word_x);
+	memset(obs->col_bits, 0, sizeof(uint64_t) * obs->size_x * obs->n_word_y);
+	memset(obs->diag_bits, 0, sizeof(uint64_t) * n_diag * obs->n_word_x);
+	memset(obs->anti_bits, 0, sizeof(uint64_t) * n_diag * obs->n_word_x);
+}
+
+void
+snake_obs_set(SnakeObs *obs, int x, int y)
+{
+	if (x < 0 || x >= obs->size_x || y < 0 || y >= obs->size_y)
+		return;
+
+	_bits_set(&obs->row_bits[y * obs->n_word_x], x);
+	_bits_set(&obs->col_bits[x * obs->n_word_y], y);
+	_bits_set(&obs->diag_bits[(x - y + obs->size_y - 1) * obs->n_word_x], x);
+	_bits_set(&obs->anti_bits[(x + y) * obs->n_word_x], x);
+}
+
+void
+snake_obs_unset(SnakeObs *obs, int x, int y)
+{
+	if (x < 0 || x >= obs->size_x || y < 0 || y >= obs->size_y)
+		return;
+
+	_bits_clear(&obs->row_bits[y * obs->n_word_x], x);
+	_bits_clear(&obs->col_bits[x * obs->n_word_y], y);
+	_bits_clear(&obs->diag_bits[(x - y + obs->size_y - 1) * obs->n_word_x], x);
+	_bits_clear(&obs->anti_bits[(x + y) * obs->n_word_x], x);
+}
+
+void
+snake_obs_encode(SnakeObs *obs, int head_x, int head_y, int food_x, int food_y, float *out)
+{
+	int n;
+
+	/* Nothing to see once the head left the field */
+	if (head_x < 0 || head_x >= obs->size_x || head_y < 0 || head_y >= obs->size_y)
+	{
+		n = snake_obs_get_n(obs->encoder, obs->vision_size) - SNAKE_OBS_N_BASIC;
+		memset(out, 0, sizeof(float) * n);
+		return;
+	}
+
+	switch (obs->encoder)
+	{
+		case OBS_ENCODER_RAYS:
+			_obs_encode_rays(obs, head_x, head_y, food_x, food_y, out);
+			break;
+
+		case OBS_ENCODER_VISION:
+			_obs_encode_vision(obs, head_x, head_y, food_x, food_y, out);
+			break;
+
+		default:
+			break;
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef __SNAKE_OBS_H
+#define __SNAKE_OBS_H
+
+#include <stdint.h>
+
+/*
+ * Observation encoders.
+ * Every encoder starts with the 8 basic values (4 distances to hit, 4 signed distances to food),
+ * the extended ones append more values after them.
+ */
+typedef enum {
+	OBS_ENCODER_BASIC,	/* Only the 8 basic values */
+	OBS_ENCODER_RAYS,	/* Plus distance to wall, body and food along 8 directions */
+	OBS_ENCODER_VISION,	/* Plus a k x k window around the head */
+} OBS_ENCODER;
+
+/* Number of basic values */
+#define SNAKE_OBS_N_BASIC	8
+
+/* Cell values of the vision window */
+#define SNAKE_OBS_CELL_EMPTY	0.0f
+#define SNAKE_OBS_CELL_BODY		1.0f
+#define SNAKE_OBS_CELL_FOOD		2.0f
+#define SNAKE_OBS_CELL_WALL		-1.0f
+
+/*
+ * Incrementally maintained fields of an extended encoder.
+ * The snake's cells are kept as bitsets per row, column, diagonal and anti-diagonal,
+ * so a ray is a bit scan from the head instead of a walk over the body.
+ * Cells are only set and unset as the head and the tail move.
+ */
+typedef struct {
+	OBS_ENCODER encoder;
+	int vision_size;	/* k of the vision window, odd */
+	int size_x;
+	int size_y;
+
+	int n_word_x;		/* Words of a bitset indexed by x */
+	int n_word_y;		/* Words of a bitset indexed by y */
+	uint64_t *row_bits;		/* size_y bitsets indexed by x */
+	uint64_t *col_bits;		/* size_x bitsets indexed by y */
+	uint64_t *diag_bits;	/* size_x + size_y - 1 bitsets indexed by x, x - y is constant */
+	uint64_t *anti_bits;	/* size_x + size_y - 1 bitsets indexed by x, x + y is constant */
+} SnakeObs;
+
+int snake_obs_get_n(OBS_ENCODER encoder, int vision_size);
+
+SnakeObs *snake_obs_create(OBS_ENCODER encoder, int vision_size, int size_x, int size_y);
+
+void snake_obs_free(SnakeObs *obs);
+
+void snake_obs_clear(SnakeObs *obs);
+
+void snake_obs_set(SnakeObs *obs, int x, int y);
+
+void snake_obs_unset(SnakeObs *obs, int x, int y);
+
+void snake_obs_encode(SnakeObs *obs, int head_x, int head_y, int food_x, int food_y, float *out);
+
+#endif /* __SNAKE_OBS_H */
@@ -0,0 +1,261 @@
+#include "snake_replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* "SNKR", starts every replay file */
+#define REPLAY_FILE_MAGIC	0x524b4e53
+/* Version 2 adds the random generator to the rules */
+#define REPLAY_FILE_VERSION	2
+
+static int _replay_reserve(SnakeReplay *replay, int n_step);
+
+/* Returns -1 if the actions cannot grow to n_step, the replay is left as it was */
+static int
+_replay_reserve(SnakeReplay *replay, int n_step)
+{
+	unsigned char *action;
+	int cap;
+
+	if (n_step <= replay->step_cap)
+		return 0;
+
+	cap = replay->step_cap ? replay->step_cap : 256;
+	while (cap < n_step)
+		cap = cap > INT_MAX / 2 ? INT_MAX : cap * 2;
+
+	action = realloc(replay->action, ((size_t)cap + 3) / 4);
+	if (action == NULL)
+		return -1;
+	replay->action = action;
+	replay->step_cap = cap;
+
+	return 0;
+}
+
+SnakeReplay *
+snake_replay_create(void)
+{
+	SnakeReplay *replay;
+
+	replay = malloc(sizeof(*replay));
+	memset(replay, 0, sizeof(*replay));
+	replay->gen = -1;
+
+	return replay;
+}
+
+void
+snake_replay_free(SnakeReplay *replay)
+{
+	free(replay->action);
+	free(replay);
+}
+
+void
+snake_replay_start(SnakeReplay *replay, const SnakeGameConfig *config, int seed)
+{
+	replay->config = *config;
+	replay->seed = seed;
+	replay->score = 0;
+	replay->total_step_used = 0;
+	replay->total_step_to_food = 0;
+	replay->performance = 0;
+	replay->gen = -1;
+	replay->n_step = 0;
+}
+
+void
+snake_replay_record(SnakeReplay *replay, DIRECTION dir)
+{
+	int i;
+
+	i = replay->n_step;
+	if (i == INT_MAX || _replay_reserve(replay, i + 1))
+		return;
+
+	if ((i & 3) == 0)
+		replay->action[i >> 2] = 0;
+	replay->action[i >> 2] |= (dir & 3) << ((i & 3) * 2);
+	replay->n_step++;
+}
+
+void
+snake_replay_finish(SnakeReplay *replay, SnakeGame *game)
+{
+	replay->score = snake_game_get_score(game);
+	replay->total_step_used = game->total_step_used;
+	replay->total_step_to_food = game->total_step_to_food;
+	replay->performance = snake_game_get_performance(game);
+}
+
+DIRECTION
+snake_replay_get_action(SnakeReplay *replay, int step)
+{
+	return (replay->action[step >> 2] >> ((step & 3) * 2)) & 3;
+}
+
+void
+snake_replay_copy(SnakeReplay *dst, SnakeReplay *src)
+{
+	if (_replay_reserve(dst, src->n_step))
+		return;
+
+	dst->config = src->config;
+	dst->seed = src->seed;
+	dst->score = src->score;
+	dst->total_step_used = src->total_step_used;
+	dst->total_step_to_food = src->total_step_to_food;
+	dst->performance = src->performance;
+	dst->gen = src->gen;
+	dst->n_step = src->n_step;
+	memcpy(dst->action, src->action, ((size_t)src->n_step + 3) / 4);
+}
+
+int
+snake_replay_append(SnakeReplay *replay, const char *file_name)
+{
+	int ret;
+	int magic = REPLAY_FILE_MAGIC;
+	int version = REPLAY_FILE_VERSION;
+	FILE *f;
+
+	f = fopen(file_name, "a+b");
+	if (f == NULL)
+		return -1;
+
+	ret = -1;
+	fseek(f, 0, SEEK_END);
+	/* A new file starts with the header */
+	if (ftell(f) == 0)
+	{
+		if (fwrite(&magic, sizeof(magic), 1, f) != 1)
+			goto __exit;
+		if (fwrite(&version, sizeof(version), 1, f) != 1)
+			goto __exit;
+	}
+	else
+	{
+		/* Records of another version can not be mixed in */
+		rewind(f);
+		if (snake_replay_check_header(f) != REPLAY_FILE_VERSION)
+			goto __exit;
+		fseek(f, 0, SEEK_END);
+	}
+
+	ret = snake_replay_savef(replay, f);
+__exit:
+	fclose(f);
+	return ret;
+}
+
+int
+snake_replay_savef(SnakeReplay *replay, FILE *f)
+{
+	int rules[6];
+	size_t n_byte;
+
+	rules[0] = replay->config.size_x;
+	rules[1] = replay->config.size_y;
+	rules[2] = replay->config.max_step;
+	rules[3] = replay->config.food_mode;
+	rules[4] = replay->seed;
+	rules[5] = replay->config.rng;
+	if (fwrite(rules, sizeof(rules[0]), 6, f) != 6)
+		return -1;
+
+	if (fwrite(&replay->score, sizeof(replay->score), 1, f) != 1)
+		return -1;
+	if (fwrite(&replay->total_step_used, sizeof(replay->total_step_used), 1, f) != 1)
+		return -1;
+	if (fwrite(&replay->total_step_to_food, sizeof(replay->total_step_to_food), 1, f) != 1)
+		return -1;
+	if (fwrite(&replay->performance, sizeof(replay->performance), 1, f) != 1)
+		return -1;
+	if (fwrite(&replay->gen, sizeof(replay->gen), 1, f) != 1)
+		return -1;
+
+	if (fwrite(&replay->n_step, sizeof(replay->n_step), 1, f) != 1)
+		return -1;
+	n_byte = ((size_t)replay->n_step + 3) / 4;
+	if (fwrite(replay->action, 1, n_byte, f) != n_byte)
+		return -1;
+
+	return 0;
+}
+
+int
+snake_replay_loadf(SnakeReplay *replay, FILE *f, int version)
+{
+	int rules[6];
+	int n_rule;
+	size_t n_byte;
+
+	/* Games of version 1 were all played with MT19937 */
+	n_rule = version < 2 ? 5 : 6;
+	rules[5] = SNAKE_RNG_MT;
+	if (fread(rules, sizeof(rules[0]), n_rule, f) != (size_t)n_rule)
+		return -1;
+	replay->config.size_x = rules[0];
+	replay->config.size_y = rules[1];
+	replay->config.step_per_sec = 8;
+	replay->config.max_step = rules[2];
+	replay->config.food_mode = rules[3];
+	/* Replays do not run a network */
+	replay->config.obs_encoder = OBS_ENCODER_BASIC;
+	replay->config.obs_vision_size = 0;
+	/* The recorded steps end where the game ended */
+	replay->config.detect_loop = 0;
+	replay->seed = rules[4];
+	replay->config.rng = rules[5];
+
+	/* Rules a game cannot be created with mean a broken file */
+	if (rules[0] < 1 || rules[0] > SNAKE_GAME_MAX_SIZE || rules[1] < 1 || rules[1] > SNAKE_GAME_MAX_SIZE)
+		return -1;
+	if (rules[3] != FOOD_MODE_FREE_CELL && rules[3] != FOOD_MODE_LEGACY)
+		return -1;
+	if (rules[5] != SNAKE_RNG_MT && rules[5] != SNAKE_RNG_XOSHIRO)
+		return -1;
+	if (rules[2] < 1)
+		return -1;
+
+	if (fread(&replay->score, sizeof(replay->score), 1, f) != 1)
+		return -1;
+	if (fread(&replay->total_step_used, sizeof(replay->total_step_used), 1, f) != 1)
+		return -1;
+	if (fread(&replay->total_step_to_food, sizeof(replay->total_step_to_food), 1, f) != 1)
+		return -1;
+	if (fread(&replay->performance, sizeof(replay->performance), 1, f) != 1)
+		return -1;
+	if (fread(&replay->gen, sizeof(replay->gen), 1, f) != 1)
+		return -1;
+
+	if (fread(&replay->n_step, sizeof(replay->n_step), 1, f) != 1)
+		return -1;
+	/* Every meal gives max_step more steps and the field holds so many meals at most */
+	if (replay->n_step < 0 || replay->n_step > (long)rules[0] * rules[1] * rules[2])
+		return -1;
+	if (_replay_reserve(replay, replay->n_step))
+		return -1;
+	n_byte = ((size_t)replay->n_step + 3) / 4;
+	if (fread(replay->action, 1, n_byte, f) != n_byte)
+		return -1;
+
+	return 0;
+}
+
+int
+snake_replay_check_header(FILE *f)
+{
+	int magic;
+	int version;
+
+	if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != REPLAY_FILE_MAGIC)
+		return -1;
+	if (fread(&version, sizeof(version), 1, f) != 1 || version < 1 || version > REPLAY_FILE_VERSION)
+		return -1;
+
+	return version;
+}
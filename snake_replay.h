@@ -0,0 +1,52 @@
+#ifndef __SNAKE_REPLAY_H
+#define __SNAKE_REPLAY_H
+
+#include <stdio.h>
+#include "snake_game.h"
+
+/*
+ * A recorded game.
+ * The game is fully defined by its rules, its seed and the direction of every step,
+ * so only those are kept, 4 steps per byte, along with the final result.
+ */
+typedef struct {
+	SnakeGameConfig config;
+	int seed;
+
+	/* Final result */
+	int score;
+	int total_step_used;
+	int total_step_to_food;
+	float performance;
+	int gen;				/* Generation which played it, -1 if unknown */
+
+	int n_step;
+	int step_cap;			/* How many steps action can hold */
+	unsigned char *action;
+} SnakeReplay;
+
+SnakeReplay *snake_replay_create(void);
+
+void snake_replay_free(SnakeReplay *replay);
+
+void snake_replay_start(SnakeReplay *replay, const SnakeGameConfig *config, int seed);
+
+void snake_replay_record(SnakeReplay *replay, DIRECTION dir);
+
+void snake_replay_finish(SnakeReplay *replay, SnakeGame *game);
+
+DIRECTION snake_replay_get_action(SnakeReplay *replay, int step);
+
+void snake_replay_copy(SnakeReplay *dst, SnakeReplay *src);
+
+int snake_replay_append(SnakeReplay *replay, const char *file_name);
+
+int snake_replay_savef(SnakeReplay *replay, FILE *f);
+
+/* version is what snake_replay_check_header returned for the file */
+int snake_replay_loadf(SnakeReplay *replay, FILE *f, int version);
+
+/* Returns the version of the file, -1 if it is not a replay file */
+int snake_replay_check_header(FILE *f);
+
+#endif /* __SNAKE_REPLAY_H */
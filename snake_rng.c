@@ -0,0 +1,418 @@
+#include "snake_rng.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define MT_M			397
+#define MT_UPPER_MASK	0x80000000u
+#define MT_LOWER_MASK	0x7fffffffu
+#define MT_MATRIX_A		0x9908b0dfu
+#define MT_TEMPERING_MASK_B	0x9d2c5680u
+#define MT_TEMPERING_MASK_C	0xefc60000u
+
+static void _mt_power_init(void);
+static void _mt_seed(SnakeRngMT *mt, uint32_t seed);
+static uint32_t _mt_twist_one(uint32_t a, uint32_t b, uint32_t m);
+static void _mt_twist(SnakeRngMT *mt);
+static uint32_t _mt_temper(uint32_t y);
+static uint32_t _mt_next(SnakeRngMT *mt);
+static SnakeRngStream *_stream_get(uint32_t seed);
+static void _stream_ref(SnakeRngStream *stream);
+static void _stream_put(SnakeRngStream *stream);
+static void _stream_free(SnakeRngStream *stream);
+static int _stream_grow(SnakeRngStream *stream, int block);
+static uint32_t _stream_next(SnakeRng *rng);
+static uint64_t _splitmix64(uint64_t *x);
+static uint32_t _rotl(uint32_t x, int k);
+static void _xoshiro_seed(uint32_t *s, uint64_t seed);
+static uint32_t _xoshiro_next(uint32_t *s);
+
+/* 6069^i mod 2^32, every word of a seeded state is seed * 6069^i */
+static uint32_t mt_power[SNAKE_RNG_MT_N];
+static pthread_once_t mt_power_once = PTHREAD_ONCE_INIT;
+
+/* Streams of recent seeds games came back to, shared by every thread */
+static SnakeRngStream *streams[SNAKE_RNG_STREAM_MAX];
+static int n_stream;
+static unsigned long stream_clock;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_mt_power_init(void)
+{
+	int i;
+
+	mt_power[0] = 1;
+	for (i = 1; i < SNAKE_RNG_MT_N; i++)
+		mt_power[i] = 6069 * mt_power[i - 1];
+}
+
+static void
+_mt_seed(SnakeRngMT *mt, uint32_t seed)
+{
+	int i;
+
+	/*
+	 * The seeding recurrence of Knuth's generator, mt[i] = 6069 * mt[i - 1],
+	 * written without the chain so every word is independent of the others
+	 */
+	for (i = 0; i < SNAKE_RNG_MT_N; i++)
+		mt->mt[i] = seed * mt_power[i];
+
+	mt->index = SNAKE_RNG_MT_N;
+	mt->seed = seed;
+	mt->n_twist = 0;
+}
+
+static uint32_t
+_mt_twist_one(uint32_t a, uint32_t b, uint32_t m)
+{
+	uint32_t y;
+
+	y = (a & MT_UPPER_MASK) | (b & MT_LOWER_MASK);
+	return m ^ (y >> 1) ^ ((0u - (y & 1)) & MT_MATRIX_A);
+}
+
+static void
+_mt_twist(SnakeRngMT *mt)
+{
+	uint32_t *s;
+	int kk;
+
+	/* Generate the whole block at once, branch free so the loops vectorize */
+	s = mt->mt;
+	for (kk = 0; kk < SNAKE_RNG_MT_N - MT_M; kk++)
+		s[kk] = _mt_twist_one(s[kk], s[kk + 1], s[kk + MT_M]);
+	for (; kk < SNAKE_RNG_MT_N - 1; kk++)
+		s[kk] = _mt_twist_one(s[kk], s[kk + 1], s[kk + MT_M - SNAKE_RNG_MT_N]);
+	s[SNAKE_RNG_MT_N - 1] = _mt_twist_one(s[SNAKE_RNG_MT_N - 1], s[0], s[MT_M - 1]);
+
+	mt->index = 0;
+	mt->n_twist++;
+}
+
+static uint32_t
+_mt_temper(uint32_t y)
+{
+	y ^= (y >> 11);
+	y ^= (y << 7) & MT_TEMPERING_MASK_B;
+	y ^= (y << 15) & MT_TEMPERING_MASK_C;
+	y ^= (y >> 18);
+	return y;
+}
+
+static uint32_t
+_mt_next(SnakeRngMT *mt)
+{
+	if (mt->index >= SNAKE_RNG_MT_N)
+		_mt_twist(mt);
+
+	return _mt_temper(mt->mt[mt->index++]);
+}
+
+/* Take the stream of seed, from the cache or a new one */
+static SnakeRngStream *
+_stream_get(uint32_t seed)
+{
+	SnakeRngStream *stream;
+	int victim;
+	int i;
+
+	pthread_mutex_lock(&stream_lock);
+	stream_clock++;
+	for (i = 0; i < n_stream; i++)
+	{
+		if (streams[i]->seed == seed)
+		{
+			stream = streams[i];
+			atomic_fetch_add(&stream->n_ref, 1);
+			stream->last_use = stream_clock;
+			pthread_mutex_unlock(&stream_lock);
+			return stream;
+		}
+	}
+
+	stream = malloc(sizeof(*stream));
+	stream->seed = seed;
+	atomic_init(&stream->n_ref, 1);
+	stream->last_use = stream_clock;
+	pthread_mutex_init(&stream->lock, NULL);
+	_mt_seed(&stream->gen, seed);
+	atomic_init(&stream->n_block, 0);
+
+	/* Make room by dropping the least recently taken stream nobody reads */
+	victim = -1;
+	if (n_stream == SNAKE_RNG_STREAM_MAX)
+	{
+		for (i = 0; i < n_stream; i++)
+		{
+			if (atomic_load(&streams[i]->n_ref) == 0 && (victim < 0 || streams[i]->last_use < streams[victim]->last_use))
+				victim = i;
+		}
+		if (victim >= 0)
+			_stream_free(streams[victim]);
+	}
+	else
+	{
+		victim = n_stream++;
+	}
+
+	/* With every stream in use the new one lives only as long as its readers */
+	stream->cached = victim >= 0;
+	if (stream->cached)
+		streams[victim] = stream;
+	pthread_mutex_unlock(&stream_lock);
+
+	return stream;
+}
+
+/* Another generator reads a stream which is held already, so the cache cannot drop it meanwhile */
+static void
+_stream_ref(SnakeRngStream *stream)
+{
+	atomic_fetch_add(&stream->n_ref, 1);
+}
+
+static void
+_stream_put(SnakeRngStream *stream)
+{
+	int cached;
+
+	/* Read before letting go, the cache may drop an unused stream at once */
+	cached = stream->cached;
+	if (atomic_fetch_sub(&stream->n_ref, 1) == 1 && !cached)
+		_stream_free(stream);
+}
+
+static void
+_stream_free(SnakeRngStream *stream)
+{
+	int i;
+
+	for (i = 0; i < atomic_load(&stream->n_block); i++)
+		free(stream->block[i]);
+	pthread_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/* Generate the stream up to block, returns -1 when that is past the stream */
+static int
+_stream_grow(SnakeRngStream *stream, int block)
+{
+	uint32_t *words;
+	int n_block;
+	int i;
+
+	if (block >= SNAKE_RNG_STREAM_MAX_BLOCK)
+		return -1;
+
+	pthread_mutex_lock(&stream->lock);
+	n_block = atomic_load_explicit(&stream->n_block, memory_order_relaxed);
+	while (n_block <= block)
+	{
+		_mt_twist(&stream->gen);
+		words = malloc(sizeof(uint32_t) * SNAKE_RNG_MT_N);
+		for (i = 0; i < SNAKE_RNG_MT_N; i++)
+			words[i] = _mt_temper(stream->gen.mt[i]);
+		stream->gen.index = SNAKE_RNG_MT_N;
+
+		/* Readers only look at the blocks n_block counts */
+		stream->block[n_block++] = words;
+		atomic_store_explicit(&stream->n_block, n_block, memory_order_release);
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return 0;
+}
+
+static uint32_t
+_stream_next(SnakeRng *rng)
+{
+	SnakeRngStream *stream;
+	int block;
+
+	stream = rng->stream;
+	block = rng->pos / SNAKE_RNG_MT_N;
+	if (block >= atomic_load_explicit(&stream->n_block, memory_order_acquire) &&
+		_stream_grow(stream, block))
+	{
+		/* Past the end of the stream, go on from its last state */
+		if (rng->mt == NULL)
+			rng->mt = malloc(sizeof(SnakeRngMT));
+		pthread_mutex_lock(&stream->lock);
+		memcpy(rng->mt, &stream->gen, sizeof(SnakeRngMT));
+		pthread_mutex_unlock(&stream->lock);
+		rng->own = 1;
+		return _mt_next(rng->mt);
+	}
+
+	return stream->block[block][rng->pos++ % SNAKE_RNG_MT_N];
+}
+
+static uint64_t
+_splitmix64(uint64_t *x)
+{
+	uint64_t z;
+
+	z = (*x += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static uint32_t
+_rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+static void
+_xoshiro_seed(uint32_t *s, uint64_t seed)
+{
+	uint64_t a;
+	uint64_t b;
+
+	/* splitmix64 spreads close seeds apart and never gives the all zero state in practice */
+	a = _splitmix64(&seed);
+	b = _splitmix64(&seed);
+	s[0] = (uint32_t)a;
+	s[1] = (uint32_t)(a >> 32);
+	s[2] = (uint32_t)b;
+	s[3] = (uint32_t)(b >> 32);
+}
+
+static uint32_t
+_xoshiro_next(uint32_t *s)
+{
+	uint32_t result;
+	uint32_t t;
+
+	result = _rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = _rotl(s[3], 11);
+
+	return result;
+}
+
+void
+snake_rng_init(SnakeRng *rng, SNAKE_RNG type)
+{
+	rng->type = type;
+	rng->s[0] = 0;
+	rng->s[1] = 0;
+	rng->s[2] = 0;
+	rng->s[3] = 0;
+	rng->stream = NULL;
+	rng->pos = 0;
+	rng->own = 0;
+	rng->mt = NULL;
+
+	/* MT takes its stream on the first seed, games always seed before they draw */
+	if (type == SNAKE_RNG_MT)
+		pthread_once(&mt_power_once, _mt_power_init);
+}
+
+void
+snake_rng_release(SnakeRng *rng)
+{
+	if (rng->stream)
+		_stream_put(rng->stream);
+	rng->stream = NULL;
+	rng->own = 0;
+	free(rng->mt);
+	rng->mt = NULL;
+}
+
+void
+snake_rng_seed(SnakeRng *rng, unsigned long seed)
+{
+	if (rng->type != SNAKE_RNG_MT)
+	{
+		_xoshiro_seed(rng->s, (uint64_t)seed);
+		return;
+	}
+
+	/* Games reset with the same seed again and again, they only rewind */
+	if (rng->stream && rng->stream->seed == (uint32_t)seed)
+	{
+		rng->pos = 0;
+		rng->own = 0;
+		return;
+	}
+
+	/* A seed which comes again is likely to come more, its numbers are then only generated once */
+	if (rng->own && rng->stream == NULL && rng->mt->seed == (uint32_t)seed)
+	{
+		rng->stream = _stream_get((uint32_t)seed);
+		rng->pos = 0;
+		rng->own = 0;
+		return;
+	}
+
+	/* The first time a seed comes it stays out of the cache, no lock and nothing to allocate */
+	if (rng->stream)
+		_stream_put(rng->stream);
+	rng->stream = NULL;
+	if (rng->mt == NULL)
+		rng->mt = malloc(sizeof(SnakeRngMT));
+	_mt_seed(rng->mt, (uint32_t)seed);
+	rng->own = 1;
+}
+
+/* Make dst draw the same numbers as src from now on, dst has to be of the same type */
+void
+snake_rng_copy(SnakeRng *dst, const SnakeRng *src)
+{
+	memcpy(dst->s, src->s, sizeof(dst->s));
+	dst->pos = src->pos;
+
+	if (dst->stream != src->stream)
+	{
+		if (dst->stream)
+			_stream_put(dst->stream);
+		if (src->stream)
+			_stream_ref(src->stream);
+		dst->stream = src->stream;
+	}
+
+	dst->own = src->own;
+	if (!src->own)
+		return;
+
+	/* Rollouts restore the state they started from again and again, mostly only index moved */
+	if (dst->mt == NULL)
+	{
+		dst->mt = malloc(sizeof(SnakeRngMT));
+		memcpy(dst->mt, src->mt, sizeof(SnakeRngMT));
+	}
+	else if (dst->mt->seed == src->mt->seed && dst->mt->n_twist == src->mt->n_twist)
+	{
+		dst->mt->index = src->mt->index;
+	}
+	else
+	{
+		memcpy(dst->mt, src->mt, sizeof(SnakeRngMT));
+	}
+}
+
+uint32_t
+snake_rng_next(SnakeRng *rng)
+{
+	if (rng->type == SNAKE_RNG_MT)
+	{
+		if (!rng->own && rng->stream == NULL)
+			snake_rng_seed(rng, 0);
+		if (rng->own)
+			return _mt_next(rng->mt);
+		return _stream_next(rng);
+	}
+
+	return _xoshiro_next(rng->s);
+}
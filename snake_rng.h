@@ -0,0 +1,67 @@
+#ifndef __SNAKE_RNG_H
+#define __SNAKE_RNG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Words of the MT19937 state */
+#define SNAKE_RNG_MT_N	624
+
+/* Blocks of SNAKE_RNG_MT_N numbers a shared stream holds, a game drawing more goes on with its own state */
+#define SNAKE_RNG_STREAM_MAX_BLOCK	64
+/* Streams kept for seeds no game uses at the moment */
+#define SNAKE_RNG_STREAM_MAX		32
+
+typedef enum {
+	SNAKE_RNG_MT,		/* MT19937, the same numbers as the mtwister generator of old runs */
+	SNAKE_RNG_XOSHIRO,	/* xoshiro128**, 16 bytes of state and almost free to seed */
+} SNAKE_RNG;
+
+typedef struct {
+	uint32_t mt[SNAKE_RNG_MT_N];
+	int index;			/* Next word of mt to temper, SNAKE_RNG_MT_N when a new block is due */
+	uint32_t seed;
+	unsigned long n_twist;	/* Blocks generated since the seed, states of a seed only differ in index after as many */
+} SnakeRngMT;
+
+/*
+ * The MT numbers of one seed, generated once and read by every generator seeded with it.
+ * Blocks are only appended, under lock, and published by n_block.
+ */
+typedef struct SnakeRngStream {
+	uint32_t seed;
+	_Atomic int n_ref;		/* Generators reading it, only the cache takes it from 0 */
+	unsigned long last_use;	/* When a generator last took it, the least recent unused one is dropped first */
+	int cached;				/* Set once made, a cached stream is only freed by the cache */
+
+	pthread_mutex_t lock;
+	SnakeRngMT gen;			/* State after the last block */
+	_Atomic int n_block;
+	uint32_t *block[SNAKE_RNG_STREAM_MAX_BLOCK];
+} SnakeRngStream;
+
+/*
+ * A game's random generator.
+ * MT generators run on their own state for a seed they get the first time, most seeds are only played once.
+ * Seeded again with it, they read the shared stream of the seed instead, until they draw past its end.
+ */
+typedef struct {
+	SNAKE_RNG type;
+	uint32_t s[4];		/* xoshiro128** state */
+	SnakeRngStream *stream;
+	unsigned long pos;	/* Next number of the stream */
+	int own;			/* Numbers come from mt instead of the stream */
+	SnakeRngMT *mt;		/* Kept across seeds, so seeding does not allocate */
+} SnakeRng;
+
+void snake_rng_init(SnakeRng *rng, SNAKE_RNG type);
+
+void snake_rng_release(SnakeRng *rng);
+
+void snake_rng_seed(SnakeRng *rng, unsigned long seed);
+
+void snake_rng_copy(SnakeRng *dst, const SnakeRng *src);
+
+uint32_t snake_rng_next(SnakeRng *rng);
+
+#endif /* __SNAKE_RNG_H */
@@ -0,0 +1,112 @@
+#include "snake_surrogate.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#define SURROGATE_N_HIDDEN_NEURO	8
+#define SURROGATE_LEARNING_RATE		0.05f
+/* Relative fitness is clamped to this, a lucky child must not swamp what the model learnt */
+#define SURROGATE_MAX_FITNESS		2.0f
+
+static void _surrogate_diff(const float *a, const float *b, int n, int *n_diff, float *sum_sq, float *max_diff, float *sum_sq_b, float *max_b);
+
+static void
+_surrogate_diff(const float *a, const float *b, int n, int *n_diff, float *sum_sq, float *max_diff, float *sum_sq_b, float *max_b)
+{
+	float d;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		d = fabsf(a[i] - b[i]);
+		if (d != 0)
+			(*n_diff)++;
+		*sum_sq += d * d;
+		if (d > *max_diff)
+			*max_diff = d;
+
+		*sum_sq_b += b[i] * b[i];
+		if (fabsf(b[i]) > *max_b)
+			*max_b = fabsf(b[i]);
+	}
+}
+
+SnakeSurrogate *
+snake_surrogate_create(void)
+{
+	SnakeSurrogate *surrogate;
+
+	surrogate = malloc(sizeof(*surrogate));
+	surrogate->model = nn_create(SNAKE_SURROGATE_N_FEATURE,
+			1,
+			1,
+			SURROGATE_N_HIDDEN_NEURO,
+			1,
+			ACT_FUNC_TYPE_SIGMOID,
+			ACT_FUNC_TYPE_LINEAR);
+	surrogate->rate = SURROGATE_LEARNING_RATE;
+	surrogate->n_sample = 0;
+
+	return surrogate;
+}
+
+void
+snake_surrogate_free(SnakeSurrogate *surrogate)
+{
+	nn_free(surrogate->model);
+	free(surrogate);
+}
+
+/*
+ * Describe a child by how it differs from origin, the network it was bred from:
+ * the share of parameters which changed, their RMS change and their largest change,
+ * both relative to the parameters of origin.
+ * Both networks must have the same shape.
+ */
+void
+snake_surrogate_features(NeuralNetwork *child, NeuralNetwork *origin, float *features)
+{
+	int n_diff;
+	int n_param;
+	float sum_sq;
+	float max_diff;
+	float sum_sq_origin;
+	float max_origin;
+
+	n_diff = 0;
+	sum_sq = 0;
+	max_diff = 0;
+	sum_sq_origin = 0;
+	max_origin = 0;
+	n_param = child->_n_weight;
+	_surrogate_diff(child->weight, origin->weight, child->_n_weight,
+			&n_diff, &sum_sq, &max_diff, &sum_sq_origin, &max_origin);
+	if (child->use_bias)
+	{
+		n_param += child->_n_neuro;
+		_surrogate_diff(child->bias, origin->bias, child->_n_neuro,
+				&n_diff, &sum_sq, &max_diff, &sum_sq_origin, &max_origin);
+	}
+
+	features[0] = (float)n_diff / (float)n_param;
+	features[1] = sum_sq_origin > 0 ? sqrtf(sum_sq / sum_sq_origin) : 0;
+	features[2] = max_origin > 0 ? max_diff / max_origin : 0;
+}
+
+/* Guess the fitness of a child relative to the record */
+float
+snake_surrogate_predict(SnakeSurrogate *surrogate, float *features)
+{
+	return nn_run(surrogate->model, features)[0];
+}
+
+/* Learn from an evaluated child, fitness relative to the record */
+void
+snake_surrogate_train(SnakeSurrogate *surrogate, float *features, float fitness)
+{
+	if (fitness > SURROGATE_MAX_FITNESS)
+		fitness = SURROGATE_MAX_FITNESS;
+
+	nn_train(surrogate->model, features, &fitness, surrogate->rate);
+	surrogate->n_sample++;
+}
@@ -0,0 +1,31 @@
+#ifndef __SNAKE_SURROGATE_H
+#define __SNAKE_SURROGATE_H
+
+#include "neural_network.h"
+
+/* Values snake_surrogate_features describes a child with */
+#define SNAKE_SURROGATE_N_FEATURE	3
+
+/*
+ * Surrogate fitness model.
+ * A small regression network, trained online with nn_train,
+ * which guesses a child's fitness from how far it strayed from the network it was bred from.
+ * Fitness is relative to the record, so the model stays valid while the record rises.
+ */
+typedef struct {
+	NeuralNetwork *model;
+	float rate;			/* Learning rate of nn_train */
+	int n_sample;		/* Evaluated children it has learnt from */
+} SnakeSurrogate;
+
+SnakeSurrogate *snake_surrogate_create(void);
+
+void snake_surrogate_free(SnakeSurrogate *surrogate);
+
+void snake_surrogate_features(NeuralNetwork *child, NeuralNetwork *origin, float *features);
+
+float snake_surrogate_predict(SnakeSurrogate *surrogate, float *features);
+
+void snake_surrogate_train(SnakeSurrogate *surrogate, float *features, float fitness);
+
+#endif /* __SNAKE_SURROGATE_H */